@@ -0,0 +1,385 @@
+#define TABLE_IMPLEMENTATION
+#include "table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+// ./bench [section...], every section runs when none are given
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t rng(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// COUNT keys drawn from NKEYS ranks with zipf exponent S, rank 1 being the hottest
+static uint64_t* zipf(size_t nkeys, size_t count, double s, uint64_t seed) {
+    double *cdf = malloc(nkeys * sizeof(double)), sum = 0;
+    for (size_t i = 0; i < nkeys; i++)
+        cdf[i] = sum += 1. / pow(i + 1, s);
+    uint64_t *keys = malloc(count * sizeof(uint64_t));
+    for (size_t i = 0; i < count; i++) {
+        double u = (rng(&seed) >> 11) * 0x1p-53 * sum;
+        size_t lo = 0, hi = nkeys - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        // spread the ranks over the key space so hot keys don't share leaves
+        keys[i] = (lo + 1) * 0x9E3779B97F4A7C15ull;
+    }
+    free(cdf);
+    return keys;
+}
+
+#define CACHE_KEYS 1000000
+#define CACHE_OPS 10000000
+
+// table_has leaves the reference bits alone, so it degrades CLOCK to FIFO
+static void cache_run(const uint64_t *keys, size_t capacity, bool clock) {
+    table_t table = table();
+    table_cache(&table, capacity, 0, NULL, NULL);
+    size_t hits = 0;
+    uint64_t value;
+    double start = now();
+    for (size_t i = 0; i < CACHE_OPS; i++) {
+        if (clock ? table_get(&table, keys[i], &value) : table_has(&table, keys[i]))
+            hits++;
+        else
+            table_set(&table, keys[i], i);
+    }
+    double elapsed = now() - start;
+    printf("  %-5s capacity %7zu: hit ratio %5.1f%%, %6.1f Mops/s\n", clock ? "clock" : "fifo",
+           capacity, 100. * hits / CACHE_OPS, CACHE_OPS / elapsed / 1e6);
+    table_free(&table);
+}
+
+typedef struct {
+    table_t *table;
+    const uint64_t *keys;
+    size_t count;
+} cache_reader_t;
+
+static void* cache_reader(void *arg) {
+    cache_reader_t *reader = arg;
+    uint64_t value;
+    for (size_t i = 0; i < reader->count; i++)
+        table_get(reader->table, reader->keys[i], &value);
+    return NULL;
+}
+
+// concurrent table_get on a full cache, every hit sets its entry's reference bit
+static void cache_readers(const uint64_t *keys, size_t capacity, int nthreads) {
+    table_t table = table();
+    table_cache(&table, capacity, 0, NULL, NULL);
+    for (size_t i = 0; i < CACHE_OPS; i++)
+        if (!table_has(&table, keys[i]))
+            table_set(&table, keys[i], i);
+    pthread_t threads[16];
+    cache_reader_t readers[16];
+    size_t per = CACHE_OPS / nthreads;
+    double start = now();
+    for (int i = 0; i < nthreads; i++) {
+        readers[i] = (cache_reader_t){&table, keys + i * per, per};
+        pthread_create(&threads[i], NULL, cache_reader, &readers[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    printf("  %d readers: %6.1f Mops/s\n", nthreads, per * nthreads / (now() - start) / 1e6);
+    table_free(&table);
+}
+
+static void bench_cache(void) {
+    static const double skews[] = {0.8, 0.99, 1.2};
+    for (size_t s = 0; s < sizeof(skews) / sizeof(skews[0]); s++) {
+        uint64_t *keys = zipf(CACHE_KEYS, CACHE_OPS, skews[s], 0x2545F4914F6CDD1Dull + s);
+        printf("zipf %.2f over %d keys, %d ops\n", skews[s], CACHE_KEYS, CACHE_OPS);
+        for (size_t capacity = CACHE_KEYS / 100; capacity <= CACHE_KEYS / 10; capacity *= 10) {
+            cache_run(keys, capacity, false);
+            cache_run(keys, capacity, true);
+        }
+        for (int nthreads = 1; nthreads <= 4; nthreads *= 2)
+            cache_readers(keys, CACHE_KEYS / 10, nthreads);
+        free(keys);
+    }
+}
+
+#define PARALLEL_KEYS 4000000
+
+static void parallel_visit(table_t *table, uint64_t key, const char *key_str, table_entry_t *entry, void *userdata) {
+    // a little work per entry so the walk isn't purely memory bound
+    uint64_t x = entry->value;
+    for (int i = 0; i < 16; i++)
+        x = x * 0x9E3779B97F4A7C15ull + key;
+    __atomic_add_fetch((uint64_t *)userdata, x & 1, __ATOMIC_RELAXED);
+}
+
+static void bench_parallel(void) {
+    table_t table = table();
+    uint64_t state = 0x2545F4914F6CDD1Dull, sum = 0;
+    for (size_t i = 0; i < PARALLEL_KEYS; i++)
+        table_set(&table, rng(&state), i);
+    printf("each over %d random keys\n", PARALLEL_KEYS);
+    double start = now();
+    table_each(&table, &sum, parallel_visit);
+    double serial = now() - start;
+    printf("  table_each:            %6.3fs\n", serial);
+    for (size_t nthreads = 1; nthreads <= 8; nthreads *= 2) {
+        start = now();
+        table_each_parallel(&table, nthreads, &sum, parallel_visit);
+        double elapsed = now() - start;
+        printf("  each_parallel %zu thread%s: %6.3fs (%.2fx)\n", nthreads, nthreads > 1 ? "s" : " ",
+               elapsed, serial / elapsed);
+    }
+    table_free(&table);
+}
+
+#define SCAN_KEYS 2000000
+
+TABLE_DEFINE(scan_map, uint64_t, uint64_t)
+
+static void scan_sum(uint64_t key, uint64_t *value, void *userdata) {
+    *(uint64_t *)userdata += *value;
+}
+
+static void scan_run(const char *name, const uint64_t *keys) {
+    scan_map_t map = scan_map();
+    for (size_t i = 0; i < SCAN_KEYS; i++)
+        scan_map_set(&map, keys[i], i);
+    uint64_t sum = 0;
+    double start = now();
+    for (int i = 0; i < 5; i++)
+        scan_map_each(&map, scan_sum, &sum);
+    double elapsed = now() - start;
+    // everything the trie has handed out, nodes and value cells
+    double bytes = map.map.tree->vec32[imap__tree_mark__];
+    printf("  %-16s %5.1f bytes/key, scan %6.1f Mkeys/s\n", name, bytes / map.map.count,
+           5. * map.map.count / elapsed / 1e6);
+    scan_map_free(&map);
+}
+
+static void bench_scan(void) {
+    uint64_t *keys = malloc(SCAN_KEYS * sizeof(uint64_t)), state = 0x2545F4914F6CDD1Dull;
+    printf("scan of %d keys (TABLE_PREFETCH %d)\n", SCAN_KEYS, TABLE_PREFETCH);
+    for (size_t i = 0; i < SCAN_KEYS; i++)
+        keys[i] = i;
+    scan_run("dense, in order", keys);
+    for (size_t i = SCAN_KEYS - 1; i > 0; i--) {
+        size_t j = rng(&state) % (i + 1);
+        uint64_t swap = keys[i];
+        keys[i] = keys[j];
+        keys[j] = swap;
+    }
+    scan_run("dense, shuffled", keys);
+    for (size_t i = 0; i < SCAN_KEYS; i++)
+        keys[i] = rng(&state);
+    scan_run("sparse", keys);
+    free(keys);
+}
+
+#define FINGER_KEYS 2000000
+
+static void finger_run(const char *name, const uint64_t *keys) {
+    table_t table = table();
+    scan_map_t map = scan_map();
+    uint64_t value, found = 0;
+    double start = now();
+    for (size_t i = 0; i < FINGER_KEYS; i++)
+        table_set(&table, keys[i], i);
+    double insert = now() - start;
+    start = now();
+    for (size_t i = 0; i < FINGER_KEYS; i++)
+        found += table_get(&table, keys[i], &value);
+    double lookup = now() - start;
+    start = now();
+    for (size_t i = 0; i < FINGER_KEYS; i++)
+        scan_map_set(&map, keys[i], i);
+    double typed_insert = now() - start;
+    start = now();
+    for (size_t i = 0; i < FINGER_KEYS; i++)
+        found += scan_map_get(&map, keys[i], &value);
+    double typed_lookup = now() - start;
+    // the same lookups through the finger, with it switched off for the tree and walking from the
+    // root, alternated so all three see the same machine, best of 7
+    double finger = 1e9, off = 1e9, walk = 1e9;
+    imap_node_t *tree = map.map.tree;
+    for (int i = 0; i < 7; i++) {
+        start = now();
+        for (size_t j = 0; j < FINGER_KEYS; j++)
+            found += !!_imap_lookup(tree, keys[j]);
+        double elapsed = now() - start;
+        finger = elapsed < finger ? elapsed : finger;
+        scan_map_finger(&map, false);
+        start = now();
+        for (size_t j = 0; j < FINGER_KEYS; j++)
+            found += !!_imap_lookup(tree, keys[j]);
+        elapsed = now() - start;
+        off = elapsed < off ? elapsed : off;
+        scan_map_finger(&map, true);
+        start = now();
+        for (size_t j = 0; j < FINGER_KEYS; j++)
+            found += !!imap__lookup_from__(tree, tree->vec32[imap__tree_root__], keys[j]);
+        elapsed = now() - start;
+        walk = elapsed < walk ? elapsed : walk;
+    }
+    double n = FINGER_KEYS / 1e6;
+    printf("  %-10s table_t set %5.1f get %5.1f, typed set %6.1f get %6.1f, lookup %6.1f, finger off %6.1f, from the root %6.1f Mops/s%s\n",
+           name, n / insert, n / lookup, n / typed_insert, n / typed_lookup, n / finger, n / off, n / walk,
+           found == 23 * FINGER_KEYS ? "" : " (wrong)");
+    scan_map_free(&map);
+    table_free(&table);
+}
+
+static void bench_finger(void) {
+    uint64_t *keys = malloc(FINGER_KEYS * sizeof(uint64_t)), state = 0x2545F4914F6CDD1Dull;
+    printf("%d keys (TABLE_FINGER %d)\n", FINGER_KEYS, TABLE_FINGER);
+    for (size_t i = 0; i < FINGER_KEYS; i++)
+        keys[i] = i;
+    finger_run("sequential", keys);
+    // ticks with gaps, most neighbours still share a leaf
+    for (size_t i = 0; i < FINGER_KEYS; i++)
+        keys[i] = 1000000000000ull + i * 3 + (rng(&state) & 1);
+    finger_run("nearby", keys);
+    for (size_t i = 0; i < FINGER_KEYS; i++)
+        keys[i] = rng(&state);
+    finger_run("random", keys);
+    free(keys);
+}
+
+#define CLONE_KEYS 500000
+
+static void clone_insert(table_t *table, uint64_t key, const char *key_str, table_entry_t *entry, void *userdata) {
+    table_t *dst = userdata;
+    if (key_str) {
+        if (entry->type == ENTRY_STR)
+            table_set(dst, key_str, table_entry_str(entry));
+        else
+            table_set(dst, key_str, entry->value);
+    } else if (entry->type == ENTRY_STR)
+        table_set(dst, key, table_entry_str(entry));
+    else
+        table_set(dst, key, entry->value);
+}
+
+static void clone_run(const char *name, table_t *src) {
+    double best[3] = {1e9, 1e9, 1e9};
+    for (int i = 0; i < 5; i++) {
+        table_t dst = table();
+        double start = now();
+        table_each(src, &dst, clone_insert);
+        double elapsed[3] = {now() - start};
+        table_free(&dst);
+        start = now();
+        table_clone(src, &dst, 0);
+        elapsed[1] = now() - start;
+        table_free(&dst);
+        start = now();
+        table_clone(src, &dst, TABLE_CLONE_SHALLOW);
+        elapsed[2] = now() - start;
+        table_free(&dst);
+        for (int j = 0; j < 3; j++)
+            best[j] = elapsed[j] < best[j] ? elapsed[j] : best[j];
+    }
+    printf("  %-22s rebuild %6.1f ms, table_clone %6.1f ms, shallow %6.1f ms\n", name, best[0] * 1e3,
+           best[1] * 1e3, best[2] * 1e3);
+}
+
+static void bench_clone(void) {
+    table_t ints = table(), strings = table();
+    char key[32];
+    for (uint64_t i = 0; i < CLONE_KEYS; i++) {
+        table_set(&ints, i * 0x9E3779B97F4A7C15ull, i);
+        snprintf(key, sizeof(key), "key-%llu", (unsigned long long)i);
+        table_set(&strings, key, "a value past the inline limit");
+    }
+    printf("copy of %d entries, best of 5\n", CLONE_KEYS);
+    clone_run("integer keys and values", &ints);
+    clone_run("string keys and values", &strings);
+    table_free(&strings);
+    table_free(&ints);
+}
+
+#define JOURNAL_KEYS 1000000
+// fsyncs are slow enough that syncing every record only gets a fraction of the keys
+#define JOURNAL_SYNCED_KEYS 2000
+
+// sustained table_set throughput with SYNC 0 (no journal), 1 (batched fsyncs) or 2 (an fsync per
+// record), a mix of overwrites, string keys and values
+static double journal_run(int sync, size_t count) {
+    table_t table = table();
+    char key[32];
+    remove("bench.journal");
+    if (sync && !table_journal_open(&table, "bench.journal")) {
+        printf("  can't open bench.journal\n");
+        return 0;
+    }
+    double start = now();
+    for (size_t i = 0; i < count; i++) {
+        if (i % 4) {
+            table_set(&table, (uint64_t)(i % (count / 2 + 1)), i);
+        } else {
+            snprintf(key, sizeof(key), "key-%zu", i);
+            table_set(&table, key, "a value past the inline limit");
+        }
+        if (sync == 2)
+            table_journal_sync(&table);
+    }
+    if (sync)
+        table_journal_sync(&table);
+    double elapsed = now() - start;
+    if (sync == 1) {
+        start = now();
+        bool compacted = table_journal_compact(&table);
+        printf("  compacting %zu live entries %7.1f ms%s\n", table.map.count, (now() - start) * 1e3,
+               compacted ? "" : " (failed)");
+    }
+    table_free(&table);
+    remove("bench.journal");
+    return count / elapsed / 1e3;
+}
+
+static void bench_journal(void) {
+    printf("table_set with journaling, %d keys (%d with an fsync per record)\n", JOURNAL_KEYS, JOURNAL_SYNCED_KEYS);
+    double off = journal_run(0, JOURNAL_KEYS);
+    double batched = journal_run(1, JOURNAL_KEYS);
+    double synced = journal_run(2, JOURNAL_SYNCED_KEYS);
+    printf("  off %8.1f, batched (TABLE_JOURNAL_BATCH %d) %8.1f, fsync per record %8.1f Kops/s\n", off,
+           TABLE_JOURNAL_BATCH, batched, synced);
+}
+
+static const struct {
+    const char *name;
+    void(*run)(void);
+} sections[] = {
+    {"cache", bench_cache},
+    {"parallel", bench_parallel},
+    {"scan", bench_scan},
+    {"finger", bench_finger},
+    {"clone", bench_clone},
+    {"journal", bench_journal},
+};
+
+int main(int argc, const char *argv[]) {
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+        bool selected = argc < 2;
+        for (int j = 1; j < argc; j++)
+            selected |= !strcmp(argv[j], sections[i].name);
+        if (selected)
+            sections[i].run();
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include "table.hpp"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// tbl::table against std::unordered_map, ./bench_cpp
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t rng(uint64_t &state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+template <typename Map, typename Key>
+static void run(const char *name, const std::vector<Key> &keys, const std::vector<Key> &misses) {
+    Map map;
+    double start = now();
+    for (size_t i = 0; i < keys.size(); i++)
+        map[keys[i]] = i;
+    double insert = now() - start;
+    size_t found = 0;
+    start = now();
+    for (const Key &key : keys)
+        found += map.find(key) != map.end();
+    for (const Key &key : misses)
+        found += map.find(key) != map.end();
+    double lookup = now() - start;
+    start = now();
+    uint64_t sum = 0;
+    for (auto [key, value] : map)
+        sum += value;
+    double iterate = now() - start;
+    start = now();
+    for (const Key &key : keys)
+        map.erase(key);
+    double erase = now() - start;
+    double n = keys.size() / 1e6;
+    printf("  %-18s insert %6.1f  find %6.1f  iterate %7.1f  erase %6.1f Mops/s%s\n", name, n / insert,
+           2 * n / lookup, n / iterate, n / erase, found == keys.size() && sum ? "" : " (wrong)");
+}
+
+int main() {
+    const size_t count = 1000000;
+    uint64_t state = 0x2545F4914F6CDD1Dull;
+    std::vector<uint64_t> sequential, random, random_misses;
+    for (uint64_t i = 0; i < count; i++) {
+        sequential.push_back(i);
+        random.push_back(rng(state));
+        random_misses.push_back(rng(state));
+    }
+    std::vector<uint64_t> sequential_misses(count);
+    for (uint64_t i = 0; i < count; i++)
+        sequential_misses[i] = count + i;
+    std::vector<std::string> strings, string_misses;
+    for (size_t i = 0; i < count; i++) {
+        strings.push_back("key:" + std::to_string(random[i]));
+        string_misses.push_back("key:" + std::to_string(random_misses[i]));
+    }
+
+    printf("%zu sequential integer keys\n", count);
+    run<tbl::table<uint64_t, uint64_t>>("tbl::table", sequential, sequential_misses);
+    run<std::unordered_map<uint64_t, uint64_t>>("std::unordered_map", sequential, sequential_misses);
+    printf("%zu random integer keys\n", count);
+    run<tbl::table<uint64_t, uint64_t>>("tbl::table", random, random_misses);
+    run<std::unordered_map<uint64_t, uint64_t>>("std::unordered_map", random, random_misses);
+    printf("%zu string keys\n", count);
+    run<tbl::table<std::string, uint64_t>>("tbl::table", strings, string_misses);
+    run<std::unordered_map<std::string, uint64_t>>("std::unordered_map", strings, string_misses);
+    return 0;
+}
@@ -44,10 +44,9 @@
 
 #ifndef TABLE_HEADER
 #define TABLE_HEADER
-#ifdef __cplusplus
-extern "C" {
-#endif
 
+// C++ only gets the imap core and the plain function API, see table.hpp
+#ifndef __cplusplus
 #ifdef __clang__
 #define _COMPILER_CLANG
 #if __clang_major__ < 15
@@ -64,6 +63,7 @@ extern "C" {
 #ifndef typeof
 #define typeof(X) __typeof__((X))
 #endif
+#endif // __cplusplus
 
 #ifndef __has_feature
 #define __has_feature(x) 0
@@ -72,17 +72,27 @@ extern "C" {
 #define __has_extension __has_feature
 #endif
 
-#if !__has_extension(blocks)
+#if !defined(__cplusplus) && !__has_extension(blocks)
 #error your compiler does not support blocks, please use a later version of clang or gcc
 #endif
 
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #ifndef TABLE_MALLOC
 #define TABLE_MALLOC malloc
 #endif
+#ifndef TABLE_REALLOC
+#define TABLE_REALLOC realloc
+#endif
 #ifndef TABLE_FREE
 #define TABLE_FREE free
 #endif
@@ -91,11 +101,36 @@ extern "C" {
 #define TABLE_INITIAL_CAPACITY 8
 #endif
 
+// records a journal buffers before it is flushed and fsynced
+#ifndef TABLE_JOURNAL_BATCH
+#define TABLE_JOURNAL_BATCH 1024
+#endif
+
+// string values are carved from chunks of this size, strings longer than TABLE_ARENA_MAX - 1 are strdup'd
+#ifndef TABLE_ARENA_CHUNK
+#define TABLE_ARENA_CHUNK 65536
+#endif
+#ifndef TABLE_ARENA_MAX
+#define TABLE_ARENA_MAX 256
+#endif
+
+// remember the last leaf a lookup or insert reached and try it before walking from the root
+#ifndef TABLE_FINGER
+#define TABLE_FINGER 1
+#endif
+
+// prefetch the next sibling subtree while iterating, 0 to compare with `./bench scan`
+#ifndef TABLE_PREFETCH
+#define TABLE_PREFETCH 1
+#endif
+
 typedef struct imap_node_t imap_node_t;
 
 typedef struct imap_t {
     imap_node_t *tree;
     size_t count, capacity;
+    // root slot of a snapshot view with the low bit set, 0 reads the root from the tree itself
+    uint32_t root;
 } imap_t;
 
 typedef uint64_t(*table_hash_fn)(const void *data, size_t len, uint32_t seed);
@@ -107,16 +142,60 @@ typedef enum entry_type {
     ENTRY_PTR
 } table_entry_type;
 
+// the box lives in a bulk allocation from table_clone, released by table_free
+#define ENTRY_FLAG_BLOCK 0x2
+// the string/float payload belongs to the table this one was shallow cloned from
+#define ENTRY_FLAG_BORROWED 0x4
+// string values of up to 7 bytes are stored in the value word itself, see table_entry_str
+#define ENTRY_FLAG_INLINE 0x8
+// the string value was allocated from the table's arena
+#define ENTRY_FLAG_ARENA 0x10
+
+#define TABLE_CLONE_SHALLOW 0x1
+
 typedef struct table_entry {
     uint64_t value;
-    table_entry_type type;
+    table_entry_type type : 8;
+    uint32_t flags : 16;
+    // CLOCK reference bit, a byte of its own so concurrent table_get calls can set it atomically
+    uint8_t ref;
+    uint32_t expires;
 } table_entry_t;
 
-typedef struct table {
+#define _T_VALUE(E) \
+    ((E)->flags & ENTRY_FLAG_INLINE ? (uint64_t)(uintptr_t)&(E)->value : (E)->value)
+#define table_entry_str(E) \
+    ((const char *)(uintptr_t)_T_VALUE((E)))
+
+typedef struct table table_t;
+
+typedef struct table_range {
+    uint64_t lo, hi;
+} table_range_t;
+
+typedef struct table_cache {
+    size_t max_entries, max_bytes, bytes;
+    uint64_t hand;
+    void(*evict)(table_t*, uint64_t, const char*, table_entry_t*, void*);
+    // a copied block when table_cache was given one, opaque so the layout doesn't depend on blocks
+    void *evict_block;
+    void *userdata;
+} table_cache_t;
+
+struct table {
     imap_t map, keys;
     table_hash_fn hashfn;
     uint64_t seed;
-} table_t;
+    struct table_snapshots *snapshots;
+    // snapshot id of a view, 0 for the table itself
+    uint32_t view;
+    table_entry_t *block;
+    struct table_journal *journal;
+    struct table_arena *arena;
+    table_cache_t cache;
+    size_t expiring;
+    uint64_t expire_hand;
+};
 
 #define _T_TYPE(T)                          \
     _Generic((T),                           \
@@ -150,9 +229,9 @@ typedef struct table {
 #define _T_IMAP(C)                      \
     (imap_t)                            \
     {                                   \
-        .capacity = (C),                \
+        .tree = _imap_ensure(NULL, (C)),\
         .count = 0,                     \
-        .tree = _imap_ensure(NULL, (C)) \
+        .capacity = (C)                 \
     }
 #define _T_TABLE(FN, C, S)      \
     (table_t)                   \
@@ -162,12 +241,41 @@ typedef struct table {
         .map = _T_IMAP((C)),    \
         .keys = _T_IMAP((C)),   \
     }
+#ifndef __cplusplus
 #define table() \
     _T_TABLE(_table_murmur, TABLE_INITIAL_CAPACITY, 0)
 #define table_ex(FN, CAPACITY, SEED) \
     (_T_TABLE((FN), ((CAPACITY) > TABLE_INITIAL_CAPACITY ? (CAPACITY) : TABLE_INITIAL_CAPACITY), (SEED)))
+#endif
 
 void table_free(table_t *table);
+// whether lookups and inserts try the last leaf they reached first (on by default), off for
+// random access from many threads
+void table_finger(table_t *table, bool enable);
+// remove up to BUDGET expired entries, returns the number removed
+size_t table_expire(table_t *table, size_t budget);
+// read-only view sharing storage with table, release with table_free
+table_t table_snapshot(table_t *table);
+// independent copy of src in dst. TABLE_CLONE_SHALLOW shares string/float values and key strings
+// with src instead: src must outlive dst and must not overwrite or delete the shared keys (any
+// table_set, table_del, eviction or expiry of them frees what dst reads), so caches, snapshots
+// and tables with TTL entries are refused
+bool table_clone(table_t *src, table_t *dst, int flags);
+// replay PATH into table (if it exists) then append every change to it, closed by table_free
+bool table_journal_open(table_t *table, const char *path);
+// flush and fsync buffered records now instead of waiting for TABLE_JOURNAL_BATCH of them
+bool table_journal_sync(table_t *table);
+void table_journal_close(table_t *table);
+// apply the records in PATH to table, false if it stops at a corrupt record (a torn last one is skipped)
+bool table_journal_replay(table_t *table, const char *path);
+// rewrite the journal as one record per live entry
+bool table_journal_compact(table_t *table);
+// bound the table to MAX_ENTRIES and/or MAX_BYTES (0 = unbounded), evicting with CLOCK on table_set.
+// bytes count the entries and their values, not key strings
+#define table_cache(T, MAX_ENTRIES, MAX_BYTES, FN, USERDATA)                                       \
+    _Generic((FN),                                                                              \
+        void(^)(table_t *, uint64_t, const char *, table_entry_t *, void *): _table_cache_block,   \
+        default: _table_cache_fn)((T), (MAX_ENTRIES), (MAX_BYTES), (FN), (USERDATA))
 
 #define table_set(T, A, B)                                  \
     _Generic((int (*)[_T_TYPE(A)][_T_TYPE(B)])NULL,         \
@@ -200,7 +308,7 @@ void table_free(table_t *table);
         if (!_entry)                                        \
             return false;                                   \
         if (_v)                                             \
-            *_v = (typeof(*_v))_entry->value;               \
+            *_v = (typeof(*_v))_T_VALUE(_entry);            \
         return true;                                        \
     })((T), (K), (V))
 
@@ -215,11 +323,44 @@ void table_free(table_t *table);
         return _table_has(_t, _key) ? _table_del(_t, _key) : false; \
     })((T), (K))
 
+#define _T_KEY(T, K)                        \
+    _Generic((int (*)[_T_TYPE(K)])NULL,     \
+        int(*)[ENTRY_INT]: _table_get_int,  \
+        int(*)[ENTRY_STR]: _table_key_str,  \
+        int(*)[ENTRY_PTR]: _table_get_void)((T), (K))
+
+#define table_incr(T, K, DELTA) \
+    _table_incr((T), _T_KEY((T), (K)), (int64_t)(DELTA))
+
+#define table_incr_atomic(T, K, DELTA, RESULT) \
+    _table_incr_atomic((T), _T_GET((T), (K)), (int64_t)(DELTA), (RESULT))
+
+#define table_set_ttl(T, K, V, TTL) \
+    _table_set_ttl((T), _T_KEY((T), (K)), _T_COERCE((T), (V)), (TTL))
+
+#define table_upsert(T, K, USERDATA, FN)                                                    \
+    _Generic((FN),                                                                          \
+        void(*)(table_t *, uint64_t, table_entry_t *, bool, void *): _table_upsert_fn,      \
+        void(^)(table_t *, uint64_t, table_entry_t *, bool, void *): _table_upsert_block)((T), _T_KEY((T), (K)), (FN), (USERDATA))
+
 #define table_each(T, USERDATA, FN)                                                 \
     _Generic((FN),                                                                  \
         void(*)(table_t *, uint64_t, const char *, table_entry_t *, void *): _table_each_fn,  \
         void(^)(table_t *, uint64_t, const char *, table_entry_t *, void *): _table_each_block)((T), (FN), (USERDATA))
 
+// split the key space into at most COUNT disjoint ranges at radix boundaries, returns the number of ranges
+size_t table_split(table_t *table, table_range_t *ranges, size_t count);
+
+#define table_each_range(T, RANGE, USERDATA, FN)                                                \
+    _Generic((FN),                                                                              \
+        void(*)(table_t *, uint64_t, const char *, table_entry_t *, void *): _table_each_range_fn,  \
+        void(^)(table_t *, uint64_t, const char *, table_entry_t *, void *): _table_each_range_block)((T), (RANGE), (FN), (USERDATA))
+
+#define table_each_parallel(T, NTHREADS, USERDATA, FN)                                              \
+    _Generic((FN),                                                                                  \
+        void(*)(table_t *, uint64_t, const char *, table_entry_t *, void *): _table_each_parallel_fn,   \
+        void(^)(table_t *, uint64_t, const char *, table_entry_t *, void *): _table_each_parallel_block)((T), (NTHREADS), (FN), (USERDATA))
+
 // please ignore these, thank you x
 uint64_t _table_murmur(const void *data, size_t len, uint32_t seed);
 bool _table_set_int(table_t *table, uint64_t key, uint64_t value);
@@ -237,28 +378,23 @@ uint64_t _table_get_int(table_t *table, uint64_t key);
 uint64_t _table_get_flt(table_t *table, uint64_t key);
 uint64_t _table_get_str(table_t *table, const char *key);
 uint64_t _table_get_void(table_t *table, void *key);
+uint64_t _table_key_str(table_t *table, const char *key);
 bool _table_has(table_t *table, uint64_t key);
 bool _table_del(table_t *table, uint64_t key);
+int64_t _table_incr(table_t *table, uint64_t key, int64_t delta);
+bool _table_set_ttl(table_t *table, uint64_t key, uint64_t value, uint32_t ttl);
+bool _table_incr_atomic(table_t *table, uint64_t key, int64_t delta, int64_t *result);
+bool _table_upsert_fn(table_t *table, uint64_t key, void(*callback)(table_t*, uint64_t, table_entry_t*, bool, void*), void *userdata);
 void _table_each_fn(table_t *table, void(*callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata);
+void _table_each_range_fn(table_t *table, table_range_t range, void(*callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata);
+void _table_each_parallel_fn(table_t *table, size_t nthreads, void(*callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata);
+void _table_cache_fn(table_t *table, size_t max_entries, size_t max_bytes, void(*callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata);
+#if __has_extension(blocks)
+void _table_cache_block(table_t *table, size_t max_entries, size_t max_bytes, void(^callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata);
+bool _table_upsert_block(table_t *table, uint64_t key, void(^callback)(table_t*, uint64_t, table_entry_t*, bool, void*), void *userdata);
 void _table_each_block(table_t *table, void(^callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata);
-imap_node_t* _imap_ensure(imap_node_t *tree, uint32_t n);
-
-#ifdef __cplusplus
-}
-#endif
-#endif // TABLE_HEADER
-
-#ifdef TABLE_IMPLEMENTATION
-#include <assert.h>
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
-
-#ifndef __has_include
-#define __has_include(x) 0
-#endif
-#if __has_include(<Block.h>)
-#include <Block.h>
+void _table_each_range_block(table_t *table, table_range_t range, void(^callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata);
+void _table_each_parallel_block(table_t *table, size_t nthreads, void(^callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata);
 #endif
 
 struct imap_node_t {
@@ -269,7 +405,7 @@ struct imap_node_t {
 };
 
 #define imap__tree_root__           0
-#define imap__tree_resv__           1
+#define imap__tree_fngr__           1
 #define imap__tree_mark__           2
 #define imap__tree_size__           3
 #define imap__tree_nfre__           4
@@ -292,18 +428,27 @@ typedef struct {
     uint32_t *slot;
 } imap_pair_t;
 
+#ifdef __cplusplus
+#define imap__pair_zero__           (imap_pair_t{})
+#define imap__pair__(x, slot)       (imap_pair_t{(x), (slot)})
+#define imap__node_zero__           (imap_node_t{})
+#else
 #define imap__pair_zero__           ((imap_pair_t){0})
 #define imap__pair__(x, slot)       ((imap_pair_t){(x), (slot)})
 #define imap__node_zero__           ((imap_node_t){{{0}}})
+#endif
 
 #ifdef _MSC_VER
+#include <intrin.h>
 static inline uint32_t imap__bsr__(uint64_t x) {
     return _BitScanReverse64((unsigned long *)&x, x | 1), (unsigned long)x;
 }
+#define imap__prefetch__(p)         (_mm_prefetch((const char *)(p), _MM_HINT_T0))
 #else
 static inline uint32_t imap__bsr__(uint64_t x) {
     return 63 - __builtin_clzll(x | 1);
 }
+#define imap__prefetch__(p)         (__builtin_prefetch((p)))
 #endif
 
 static inline uint32_t imap__xpos__(uint64_t x) {
@@ -415,7 +560,51 @@ static inline uint32_t imap__alloc_node__(imap_node_t *tree) {
     return mark;
 }
 
+// concurrent table_get/table_has readers share the finger, so it is only accessed atomically
+#if !TABLE_FINGER
+#define imap__finger__(tree)            (0)
+#define imap__set_finger__(tree, mark)  ((void)0)
+#elif defined(_MSC_VER)
+#define imap__finger__(tree)            (*(volatile uint32_t *)&(tree)->vec32[imap__tree_fngr__])
+#define imap__set_finger__(tree, mark)  (imap__finger__(tree) = (mark))
+#else
+#define imap__finger__(tree)            (__atomic_load_n(&(tree)->vec32[imap__tree_fngr__], __ATOMIC_RELAXED))
+#define imap__set_finger__(tree, mark)  (__atomic_store_n(&(tree)->vec32[imap__tree_fngr__], (mark), __ATOMIC_RELAXED))
+#endif
+
+// the finger is a leaf offset with key bits 4-9 of its prefix in the low (alignment) bits,
+// so most misses are rejected without touching the node. offset 0 is the header, never a leaf,
+// which leaves a spare value to switch the finger off per tree
+#define imap__finger_tag__(x)           ((uint32_t)((x) >> 4) & 0x3f)
+#define imap__finger_off__              1u
+
+// the leaf under the finger if it holds x's prefix, leaves are unique per prefix so it is the
+// same node a walk from the root would reach
+static inline imap_node_t* imap__finger_leaf__(imap_node_t *tree, uint64_t x) {
+    uint32_t fngr = imap__finger__(tree);
+    imap_node_t *node;
+    if ((fngr & ~0x3f) && (fngr & 0x3f) == imap__finger_tag__(x) &&
+        imap__node_prefix__(node = imap__node__(tree, fngr & ~0x3f)) == (x & ~0xfull))
+        return node;
+    return 0;
+}
+
+// tested first so that repeated hits on one leaf don't keep writing the header's cache line
+static inline void imap__point_finger__(imap_node_t *tree, imap_node_t *node, uint64_t x) {
+    uint32_t fngr = (uint32_t)((uint8_t *)node - (uint8_t *)tree) | imap__finger_tag__(x), prev = imap__finger__(tree);
+    if (prev != fngr && prev != imap__finger_off__)
+        imap__set_finger__(tree, fngr);
+}
+
+// every tree starts with the finger on
+static inline void _imap_finger(imap_node_t *tree, bool enable) {
+    if (tree && (imap__finger__(tree) == imap__finger_off__) == enable)
+        imap__set_finger__(tree, enable ? 0 : imap__finger_off__);
+}
+
 static inline void imap__free_node__(imap_node_t *tree, uint32_t mark) {
+    if ((imap__finger__(tree) & ~0x3f) == mark)
+        imap__set_finger__(tree, 0);
     *(uint32_t *)((uint8_t *)tree + mark) = tree->vec32[imap__tree_nfre__];
     tree->vec32[imap__tree_nfre__] = mark;
 }
@@ -424,7 +613,8 @@ static inline uint64_t imap__xpfx__(uint64_t x, uint32_t pos) {
     return x & (~0xfull << (pos << 2));
 }
 
-imap_node_t* _imap_ensure(imap_node_t *tree, uint32_t n) {
+// room for n more keys, in a new block that is a copy of tree if it has to grow (tree is left alone)
+static inline imap_node_t* imap__grow__(imap_node_t *tree, uint32_t n) {
     imap_node_t *newtree;
     uint32_t hasnfre, hasvfre, newmark, oldsize, newsize;
     uint64_t newsize64;
@@ -456,7 +646,7 @@ imap_node_t* _imap_ensure(imap_node_t *tree, uint32_t n) {
         return newtree;
     if (!tree) {
         newtree->vec32[imap__tree_root__] = 0;
-        newtree->vec32[imap__tree_resv__] = 0;
+        newtree->vec32[imap__tree_fngr__] = 0;
         newtree->vec32[imap__tree_mark__] = sizeof(imap_node_t);
         newtree->vec32[imap__tree_size__] = newsize;
         newtree->vec32[imap__tree_nfre__] = 0;
@@ -468,33 +658,64 @@ imap_node_t* _imap_ensure(imap_node_t *tree, uint32_t n) {
         newtree->vec64[7] = 0;
     } else {
         memcpy(newtree, tree, tree->vec32[imap__tree_mark__]);
-        IMAP_ALIGNED_FREE(tree);
         newtree->vec32[imap__tree_size__] = newsize;
     }
     return newtree;
 }
 
-static uint32_t *imap_lookup(imap_node_t *tree, uint64_t x) {
-    imap_node_t *node = tree;
-    uint32_t *slot;
-    uint32_t sval, posn = 16, dirn = 0;
-    for (;;) {
-        slot = &node->vec32[dirn];
-        sval = *slot;
+static inline imap_node_t* _imap_ensure(imap_node_t *tree, uint32_t n) {
+    imap_node_t *newtree = imap__grow__(tree, n);
+    if (newtree && tree && newtree != tree)
+        IMAP_ALIGNED_FREE(tree);
+    return newtree;
+}
+
+// walk down from the root slot value sval, ignoring the finger
+static inline uint32_t *imap__lookup_from__(imap_node_t *tree, uint32_t sval, uint64_t x) {
+    imap_node_t *node;
+    uint32_t posn;
+    while (sval & imap__slot_node__) {
+        node = imap__node__(tree, sval & imap__slot_value__);
+        posn = imap__node_pos__(node);
+        sval = node->vec32[imap__xdir__(x, posn)];
         if (!(sval & imap__slot_node__)) {
             if ((sval & imap__slot_value__) && imap__node_prefix__(node) == (x & ~0xfull)) {
                 assert(0 == posn);
-                return slot;
+                return &node->vec32[x & 0xfull];
             }
             return 0;
         }
-        node = imap__node__(tree, sval & imap__slot_value__);
-        posn = imap__node_pos__(node);
-        dirn = imap__xdir__(x, posn);
     }
+    return 0;
+}
+
+// lookups run concurrently and the finger shares the header's cache line with the root, so a
+// lookup only moves it to continue a run: onto the leaf after or before the finger's (checked by
+// tag, then prefix). one leaf in 64 (tag 0) also takes it so that a new run can start, leaving
+// random lookups to write the header about once per 64
+static inline uint32_t *_imap_lookup(imap_node_t *tree, uint64_t x) {
+    uint32_t fngr = imap__finger__(tree), tag = imap__finger_tag__(x), *slot;
+    imap_node_t *node;
+    uint64_t prefix;
+    if (fngr == imap__finger_off__)
+        return imap__lookup_from__(tree, tree->vec32[imap__tree_root__], x);
+    if ((fngr & ~0x3f) && (fngr & 0x3f) == tag &&
+        imap__node_prefix__(node = imap__node__(tree, fngr & ~0x3f)) == (x & ~0xfull)) {
+        slot = &node->vec32[x & 0xfull];
+        return *slot & imap__slot_value__ ? slot : 0;
+    }
+    if (!(slot = imap__lookup_from__(tree, tree->vec32[imap__tree_root__], x)))
+        return slot;
+    if (tag && !((fngr & ~0x3f) && ((tag - fngr + 1) & 0x3f) <= 2 &&
+                 ((prefix = imap__node_prefix__(imap__node__(tree, fngr & ~0x3f))) == (x & ~0xfull) - 0x10 ||
+                  prefix == (x & ~0xfull) + 0x10)))
+        return slot;
+    // nodes are aligned to their size, so the leaf is the slot's node
+    imap__point_finger__(tree, (imap_node_t *)((uintptr_t)slot & ~(uintptr_t)(sizeof(imap_node_t) - 1)), x);
+    return slot;
 }
 
-static uint32_t *imap_assign(imap_node_t *tree, uint64_t x) {
+static inline uint32_t *_imap_assign(imap_node_t *tree, uint64_t x) {
     uint32_t *slotstack[16 + 1];
     uint32_t posnstack[16 + 1];
     uint32_t stackp, stacki;
@@ -502,6 +723,8 @@ static uint32_t *imap_assign(imap_node_t *tree, uint64_t x) {
     uint32_t *slot;
     uint32_t newmark, sval, diff, posn = 16, dirn = 0;
     uint64_t prfx;
+    if ((newnode = imap__finger_leaf__(tree, x)))
+        return &newnode->vec32[x & 0xfull];
     stackp = 0;
     for (;;) {
         slot = &node->vec32[dirn];
@@ -509,8 +732,10 @@ static uint32_t *imap_assign(imap_node_t *tree, uint64_t x) {
         slotstack[stackp] = slot, posnstack[stackp++] = posn;
         if (!(sval & imap__slot_node__)) {
             prfx = imap__node_prefix__(node);
-            if (0 == posn && prfx == (x & ~0xfull))
+            if (0 == posn && prfx == (x & ~0xfull)) {
+                imap__point_finger__(tree, node, x);
                 return slot;
+            }
             diff = imap__xpos__(prfx ^ x);
             assert(diff < 16);
             for (stacki = stackp; diff > posn;)
@@ -534,6 +759,7 @@ static uint32_t *imap_assign(imap_node_t *tree, uint64_t x) {
             newnode = imap__node__(tree, newmark);
             *newnode = imap__node_zero__;
             imap__node_setprefix__(newnode, x & ~0xfull);
+            imap__point_finger__(tree, newnode, x);
             return &newnode->vec32[x & 0xfull];
         }
         node = imap__node__(tree, sval & imap__slot_value__);
@@ -558,13 +784,13 @@ static inline uint32_t imap__alloc_val__(imap_node_t *tree) {
     return mark;
 }
 
-static uint64_t imap_getval64(imap_node_t *tree, uint32_t *slot) {
+static inline uint64_t _imap_getval64(imap_node_t *tree, uint32_t *slot) {
     assert(!(*slot & imap__slot_node__));
     uint32_t sval = *slot;
     return tree->vec64[sval >> imap__slot_shift__];
 }
 
-static void imap_setval64(imap_node_t *tree, uint32_t *slot, uint64_t y) {
+static inline void _imap_setval64(imap_node_t *tree, uint32_t *slot, uint64_t y) {
     assert(!(*slot & imap__slot_node__));
     uint32_t sval = *slot;
     if (!(sval >> imap__slot_shift__))
@@ -581,7 +807,7 @@ static void imap_setval64(imap_node_t *tree, uint32_t *slot, uint64_t y) {
     tree->vec64[sval >> imap__slot_shift__] = y;
 }
 
-static void imap_delval(imap_node_t *tree, uint32_t *slot) {
+static inline void _imap_delval(imap_node_t *tree, uint32_t *slot) {
     assert(!(*slot & imap__slot_node__));
     uint32_t sval = *slot;
     if (imap__slot_boxed__(sval)) {
@@ -591,12 +817,23 @@ static void imap_delval(imap_node_t *tree, uint32_t *slot) {
     *slot &= imap__slot_pmask__;
 }
 
-static void imap_remove(imap_node_t *tree, uint64_t x) {
+static inline void _imap_remove(imap_node_t *tree, uint64_t x) {
     uint32_t *slotstack[16 + 1];
     uint32_t stackp;
-    imap_node_t *node = tree;
+    imap_node_t *node;
     uint32_t *slot;
     uint32_t sval, pval, posn = 16, dirn = 0;
+    // only emptying a leaf changes the shape of the tree, which needs the path from the root
+    if ((node = imap__finger_leaf__(tree, x))) {
+        slot = &node->vec32[x & 0xfull];
+        if (!(*slot & imap__slot_value__))
+            return;
+        if (1 < imap__node_popcnt__(node, &pval)) {
+            _imap_delval(tree, slot);
+            return;
+        }
+    }
+    node = tree;
     stackp = 0;
     for (;;) {
         slot = &node->vec32[dirn];
@@ -604,7 +841,7 @@ static void imap_remove(imap_node_t *tree, uint64_t x) {
         if (!(sval & imap__slot_node__)) {
             if ((sval & imap__slot_value__) && imap__node_prefix__(node) == (x & ~0xfull)) {
                 assert(0 == posn);
-                imap_delval(tree, slot);
+                _imap_delval(tree, slot);
             }
             while (stackp) {
                 slot = slotstack[--stackp];
@@ -625,7 +862,7 @@ static void imap_remove(imap_node_t *tree, uint64_t x) {
     }
 }
 
-static imap_pair_t imap_iterate(imap_node_t *tree, imap_iter_t *iter, int restart) {
+static inline imap_pair_t _imap_iterate(imap_node_t *tree, imap_iter_t *iter, int restart) {
     imap_node_t *node;
     uint32_t *slot;
     uint32_t sval, dirn;
@@ -648,15 +885,214 @@ static imap_pair_t imap_iterate(imap_node_t *tree, imap_iter_t *iter, int restar
         node = imap__node__(tree, sval & imap__slot_value__);
         slot = &node->vec32[dirn];
         sval = *slot;
-        if (sval & imap__slot_node__)
+        if (sval & imap__slot_node__) {
+            // leaves are rarely adjacent in memory unless inserted in order, start
+            // loading the next sibling while this subtree is walked
+            if (TABLE_PREFETCH && 15 > dirn && (node->vec32[dirn + 1] & imap__slot_node__))
+                imap__prefetch__(imap__node__(tree, node->vec32[dirn + 1] & imap__slot_value__));
             // push node into stack
             iter->stack[iter->stackp++] = sval & imap__slot_value__;
-        else if (sval & imap__slot_value__)
+        } else if (sval & imap__slot_value__)
             return imap__pair__(imap__node_prefix__(node) | dirn, slot);
     }
     return imap__pair_zero__;
 }
 
+// _imap_seek below the root slot value sval
+static inline void imap__seek_from__(imap_node_t *tree, imap_iter_t *iter, uint32_t sval, uint64_t x) {
+    imap_node_t *node;
+    uint32_t posn, dirn;
+    uint64_t prfx, xpfx;
+    iter->stackp = 0;
+    while (sval & imap__slot_node__) {
+        node = imap__node__(tree, sval & imap__slot_value__);
+        posn = imap__node_pos__(node);
+        prfx = imap__xpfx__(imap__node_prefix__(node), posn);
+        xpfx = imap__xpfx__(x, posn);
+        if (xpfx != prfx) {
+            // node lies entirely before or after x
+            if (xpfx < prfx)
+                iter->stack[iter->stackp++] = sval & imap__slot_value__;
+            return;
+        }
+        dirn = imap__xdir__(x, posn);
+        if (0 == posn) {
+            iter->stack[iter->stackp++] = (sval & imap__slot_value__) | dirn;
+            return;
+        }
+        // resume after this direction once the child subtree is exhausted
+        iter->stack[iter->stackp++] = (sval & imap__slot_value__) | (dirn + 1);
+        sval = node->vec32[dirn];
+    }
+}
+
+// position iter so the next _imap_iterate(tree, iter, 0) returns the first key >= x
+static inline void _imap_seek(imap_node_t *tree, imap_iter_t *iter, uint64_t x) {
+    imap__seek_from__(tree, iter, tree->vec32[imap__tree_root__], x);
+}
+
+static inline uint32_t *_imap_slot(imap_t *map, uint64_t key) {
+    if (map->count + 1 >= map->capacity) {
+        imap_node_t *tree = _imap_ensure(map->tree, map->capacity * 2);
+        if (!tree)
+            return NULL;
+        map->tree = tree;
+        map->capacity *= 2;
+    }
+    return _imap_assign(map->tree, key);
+}
+
+static inline bool _imap_set(imap_t *map, uint64_t key, uint64_t value) {
+    uint32_t *slot = _imap_slot(map, key);
+    if (!slot)
+        return false;
+    if (!(*slot & imap__slot_value__))
+        map->count++;
+    _imap_setval64(map->tree, slot, value);
+    return true;
+}
+
+// TABLE_DEFINE(NAME, K, V) generates NAME_t, a homogeneous table from K (integer or pointer)
+// to V without entry boxes or type tags. Values up to 8 bytes live in the imap value cell,
+// larger ones in a contiguous slab indexed by the cell (pointers into it move on growth).
+//   NAME_t NAME(void);
+//   void NAME_free(NAME_t *table);
+//   bool NAME_set(NAME_t *table, K key, V value);
+//   bool NAME_get(NAME_t *table, K key, V *value);
+//   V* NAME_ref(NAME_t *table, K key);
+//   bool NAME_has(NAME_t *table, K key);
+//   bool NAME_del(NAME_t *table, K key);
+//   void NAME_finger(NAME_t *table, bool enable);
+//   void NAME_each(NAME_t *table, void(*callback)(K key, V *value, void *userdata), void *userdata);
+#define TABLE_DEFINE(NAME, K, V)                                                            \
+    typedef struct NAME##_t {                                                               \
+        imap_t map;                                                                         \
+        V *slab;                                                                            \
+        uint32_t slab_count, slab_capacity, slab_free;                                      \
+    } NAME##_t;                                                                             \
+                                                                                            \
+    static inline NAME##_t NAME(void) {                                                     \
+        return (NAME##_t){.map = _T_IMAP(TABLE_INITIAL_CAPACITY)};                          \
+    }                                                                                       \
+                                                                                            \
+    static inline void NAME##_free(NAME##_t *table) {                                       \
+        IMAP_ALIGNED_FREE(table->map.tree);                                                 \
+        TABLE_FREE(table->slab);                                                            \
+        memset(table, 0, sizeof(NAME##_t));                                                 \
+    }                                                                                       \
+                                                                                            \
+    static inline V* NAME##__value__(NAME##_t *table, uint32_t *slot) {                     \
+        uint64_t *cell = &table->map.tree->vec64[*slot >> imap__slot_shift__];              \
+        if (sizeof(V) <= sizeof(uint64_t))                                                  \
+            return (V *)cell;                                                               \
+        return &table->slab[*cell];                                                         \
+    }                                                                                       \
+                                                                                            \
+    static inline bool NAME##_set(NAME##_t *table, K key, V value) {                        \
+        uint64_t cell = 0;                                                                  \
+        uint32_t *slot = _imap_slot(&table->map, (uint64_t)(uintptr_t)key);                 \
+        if (!slot)                                                                          \
+            return false;                                                                   \
+        if (*slot & imap__slot_value__) {                                                   \
+            *NAME##__value__(table, slot) = value;                                          \
+            return true;                                                                    \
+        }                                                                                   \
+        if (sizeof(V) <= sizeof(uint64_t))                                                  \
+            memcpy(&cell, &value, sizeof(V));                                               \
+        else if (table->slab_free) {                                                        \
+            cell = table->slab_free - 1;                                                    \
+            memcpy(&table->slab_free, &table->slab[cell], sizeof(uint32_t));                \
+            table->slab[cell] = value;                                                      \
+        } else {                                                                            \
+            if (table->slab_count == table->slab_capacity) {                                \
+                uint32_t capacity = table->slab_capacity ? table->slab_capacity * 2 : TABLE_INITIAL_CAPACITY; \
+                V *slab = (V *)TABLE_REALLOC(table->slab, capacity * sizeof(V));            \
+                if (!slab)                                                                  \
+                    return false;                                                           \
+                table->slab = slab;                                                         \
+                table->slab_capacity = capacity;                                            \
+            }                                                                               \
+            cell = table->slab_count++;                                                     \
+            table->slab[cell] = value;                                                      \
+        }                                                                                   \
+        _imap_setval64(table->map.tree, slot, cell);                                        \
+        table->map.count++;                                                                 \
+        return true;                                                                        \
+    }                                                                                       \
+                                                                                            \
+    static inline V* NAME##_ref(NAME##_t *table, K key) {                                   \
+        uint32_t *slot = _imap_lookup(table->map.tree, (uint64_t)(uintptr_t)key);           \
+        return slot ? NAME##__value__(table, slot) : NULL;                                  \
+    }                                                                                       \
+                                                                                            \
+    static inline bool NAME##_get(NAME##_t *table, K key, V *value) {                       \
+        V *ref = NAME##_ref(table, key);                                                    \
+        if (ref && value)                                                                   \
+            *value = *ref;                                                                  \
+        return !!ref;                                                                       \
+    }                                                                                       \
+                                                                                            \
+    static inline bool NAME##_has(NAME##_t *table, K key) {                                 \
+        return !!_imap_lookup(table->map.tree, (uint64_t)(uintptr_t)key);                   \
+    }                                                                                       \
+                                                                                            \
+    static inline bool NAME##_del(NAME##_t *table, K key) {                                 \
+        uint32_t *slot = _imap_lookup(table->map.tree, (uint64_t)(uintptr_t)key);           \
+        if (!slot)                                                                          \
+            return false;                                                                   \
+        if (sizeof(V) > sizeof(uint64_t)) {                                                 \
+            uint64_t cell = _imap_getval64(table->map.tree, slot);                          \
+            memcpy(&table->slab[cell], &table->slab_free, sizeof(uint32_t));                \
+            table->slab_free = (uint32_t)cell + 1;                                          \
+        }                                                                                   \
+        _imap_remove(table->map.tree, (uint64_t)(uintptr_t)key);                            \
+        table->map.count--;                                                                 \
+        return true;                                                                        \
+    }                                                                                       \
+                                                                                            \
+    static inline void NAME##_finger(NAME##_t *table, bool enable) {                        \
+        _imap_finger(table->map.tree, enable);                                              \
+    }                                                                                       \
+                                                                                            \
+    static inline void NAME##_each(NAME##_t *table, void(*callback)(K, V*, void*), void *userdata) { \
+        imap_iter_t iter;                                                                   \
+        imap_pair_t pair;                                                                   \
+        for (pair = _imap_iterate(table->map.tree, &iter, 1); pair.slot; pair = _imap_iterate(table->map.tree, &iter, 0)) \
+            callback((K)(uintptr_t)pair.x, NAME##__value__(table, pair.slot), userdata);    \
+    }
+
+#ifdef __cplusplus
+}
+#endif
+#endif // TABLE_HEADER
+
+#ifdef TABLE_IMPLEMENTATION
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+#define ftruncate _chsize
+#define fileno _fileno
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#ifndef __has_include
+#define __has_include(x) 0
+#endif
+#if __has_include(<Block.h>)
+#include <Block.h>
+#else
+void *_Block_copy(const void *block);
+void _Block_release(const void *block);
+#define Block_copy(block) ((__typeof__(block))_Block_copy((const void *)(block)))
+#define Block_release(block) _Block_release((const void *)(block))
+#endif
+
 #define ROTL32(x, r) ((x << r) | (x >> (32 - r)))
 #define FMIX32(h) h^=h>>16; h*=0x85ebca6b; h^=h>>13; h*=0xc2b2ae35; h^=h>>16;
 
@@ -745,59 +1181,997 @@ uint64_t _table_murmur(const void *data, size_t len, uint32_t seed) {
     return *(uint64_t*)out;
 }
 
-#define _ENTRY(T, V)                                                \
-    do                                                              \
-    {                                                               \
-        table_entry_t *entry = TABLE_MALLOC(sizeof(table_entry_t)); \
-        entry->type = (T);                                          \
-        entry->value = (V);                                         \
-        return (uintptr_t)entry;                                    \
+#define _ENTRY(T, V, F)                                                     \
+    do                                                                      \
+    {                                                                       \
+        table_entry_t *entry = TABLE_MALLOC(sizeof(table_entry_t));         \
+        *entry = (table_entry_t){.value = (V), .type = (T), .flags = (F)};  \
+        return (uintptr_t)entry;                                            \
     } while (0)
 
+// freed strings are kept on a list per 8 byte size class, each chunk starts with a link to the previous one
+struct table_arena {
+    char *chunk;
+    size_t used;
+    void *free[TABLE_ARENA_MAX / 8];
+};
+
+static bool _table_detach(table_t *table);
+
+static char* _table_arena_alloc(table_t *table, size_t size) {
+    struct table_arena *arena;
+    void **head;
+    char *str;
+    size = (size + 7) & ~(size_t)7;
+    // views have no arena, writing to one makes it an independent table first
+    if (size > TABLE_ARENA_MAX || (table->view && !_table_detach(table)))
+        return NULL;
+    if (!(arena = table->arena)) {
+        if (!(arena = table->arena = TABLE_MALLOC(sizeof(struct table_arena))))
+            return NULL;
+        memset(arena, 0, sizeof(struct table_arena));
+    }
+    if (*(head = &arena->free[size / 8 - 1])) {
+        str = *head;
+        *head = *(void **)str;
+        return str;
+    }
+    if (!arena->chunk || arena->used + size > TABLE_ARENA_CHUNK) {
+        if (!(str = TABLE_MALLOC(TABLE_ARENA_CHUNK)))
+            return NULL;
+        // the tail of the old chunk is too small for this string but not for the next one
+        if (arena->chunk && TABLE_ARENA_CHUNK - arena->used >= 16) {
+            head = &arena->free[(TABLE_ARENA_CHUNK - arena->used) / 8 - 1];
+            *(void **)(arena->chunk + arena->used) = *head;
+            *head = arena->chunk + arena->used;
+        }
+        *(char **)str = arena->chunk;
+        arena->chunk = str;
+        arena->used = sizeof(char *);
+    }
+    str = arena->chunk + arena->used;
+    arena->used += size;
+    return str;
+}
+
+static void _table_arena_free(struct table_arena *arena, char *str) {
+    void **head = &arena->free[((strlen(str) + 8) & ~(size_t)7) / 8 - 1];
+    *(void **)str = *head;
+    *head = str;
+}
+
+static void _table_arena_destroy(struct table_arena *arena) {
+    char *chunk, *prev;
+    if (!arena)
+        return;
+    for (chunk = arena->chunk; chunk; chunk = prev) {
+        prev = *(char **)chunk;
+        TABLE_FREE(chunk);
+    }
+    TABLE_FREE(arena);
+}
+
+// value word and storage flag for a copy of str
+static uint64_t _table_str_store(table_t *table, const char *str, uint32_t *flags) {
+    size_t len = strlen(str);
+    uint64_t value = 0;
+    char *copy;
+    if (len < sizeof(uint64_t)) {
+        // zero padded, so the word always holds a terminated string
+        memcpy(&value, str, len);
+        *flags = ENTRY_FLAG_INLINE;
+        return value;
+    }
+    if ((copy = _table_arena_alloc(table, len + 1))) {
+        memcpy(copy, str, len + 1);
+        *flags = ENTRY_FLAG_ARENA;
+        return (uintptr_t)copy;
+    }
+    *flags = 0;
+    return (uintptr_t)strdup(str);
+}
+
 uint64_t _table_int_to_int(table_t *table, uint64_t i) {
-    _ENTRY(ENTRY_INT, i);
+    _ENTRY(ENTRY_INT, i, 0);
 }
 
 uint64_t _table_flt_to_int(table_t *table, double d) {
     double *f = TABLE_MALLOC(sizeof(double));
     *f = d;
-    _ENTRY(ENTRY_FLT, (uintptr_t)f);
+    _ENTRY(ENTRY_FLT, (uintptr_t)f, 0);
 }
 
 uint64_t _table_str_to_int(table_t *table, const char *str) {
-    _ENTRY(ENTRY_STR, (uintptr_t)strdup(str));
+    uint32_t flags;
+    uint64_t value = _table_str_store(table, str, &flags);
+    _ENTRY(ENTRY_STR, value, flags);
 }
 
 uint64_t _table_void_to_int(table_t *table, void *ptr) {
-    _ENTRY(ENTRY_PTR, (uintptr_t)ptr);
+    _ENTRY(ENTRY_PTR, (uintptr_t)ptr, 0);
+}
+
+#define _CACHED(T) ((T)->cache.max_entries || (T)->cache.max_bytes)
+
+// every table_t holding the eviction block owns a reference, views and copies included
+static void _table_retain_block(table_t *table) {
+    if (table->cache.evict_block)
+        table->cache.evict_block = (void *)Block_copy((void(^)(table_t*, uint64_t, const char*, table_entry_t*, void*))table->cache.evict_block);
+}
+
+static void _table_release_block(table_t *table) {
+    if (table->cache.evict_block)
+        Block_release((void(^)(table_t*, uint64_t, const char*, table_entry_t*, void*))table->cache.evict_block);
+    table->cache.evict_block = NULL;
+}
+
+#define _NOW() ((uint32_t)time(NULL))
+
+static inline bool _table_expired(table_entry_t *entry, uint32_t now) {
+    return entry->expires && entry->expires <= now;
+}
+
+static size_t _table_entry_size(table_entry_t *entry) {
+    switch (entry->type) {
+        case ENTRY_STR:
+            if (entry->flags & ENTRY_FLAG_INLINE)
+                return sizeof(table_entry_t);
+            return sizeof(table_entry_t) + strlen((const char *)entry->value) + 1;
+        case ENTRY_FLT:
+            return sizeof(table_entry_t) + sizeof(double);
+        default:
+            return sizeof(table_entry_t);
+    }
+}
+
+static void _table_drop_payload(table_t *table, table_entry_t *entry) {
+    if ((entry->type == ENTRY_STR || entry->type == ENTRY_FLT) && !(entry->flags & (ENTRY_FLAG_BORROWED | ENTRY_FLAG_INLINE))) {
+        if (entry->flags & ENTRY_FLAG_ARENA)
+            _table_arena_free(table->arena, (char *)entry->value);
+        else
+            free((void*)entry->value);
+    }
+    entry->flags &= ~(ENTRY_FLAG_BORROWED | ENTRY_FLAG_INLINE | ENTRY_FLAG_ARENA);
+}
+
+static void _table_release(table_t *table, table_entry_t *entry) {
+    if (!entry)
+        return;
+    _table_drop_payload(table, entry);
+    if (!(entry->flags & ENTRY_FLAG_BLOCK))
+        free(entry);
+}
+
+// key strings borrowed by a shallow clone are tagged in the low bit
+#define _KEY_BORROWED 0x1
+
+static inline const char* _table_key_ptr(uint64_t value) {
+    return (const char *)(uintptr_t)(value & ~(uint64_t)_KEY_BORROWED);
+}
+
+static inline void _table_key_free(uint64_t value) {
+    if (!(value & _KEY_BORROWED))
+        free((void*)(uintptr_t)value);
 }
 
-static inline bool imap_set(imap_t *map, uint64_t key, uint64_t value) {
-    uint32_t *slot = imap_lookup(map->tree, key);
-    if (slot) {
-        imap_setval64(map->tree, slot, value);
+// entry boxes a snapshot may still see are tagged in the low bit of the value cell holding them
+#define _SHARED 0x1
+#define _BOX(V) ((table_entry_t *)(uintptr_t)((V) & ~(uint64_t)_SHARED))
+
+#define _T_ROOT(M) ((M)->root ? (M)->root & ~1u : (M)->tree->vec32[imap__tree_root__])
+
+// snapshot views walk from their own root and leave the finger to the table
+static inline uint32_t* _table_lookup(imap_t *map, uint64_t x) {
+    return map->root ? imap__lookup_from__(map->tree, map->root & ~1u, x) : _imap_lookup(map->tree, x);
+}
+
+// lookup that leaves the finger alone, for walks and counters that run on several threads at
+// once, where each thread would only drag the finger away from the others
+static inline uint32_t* _table_peek(imap_t *map, uint64_t x) {
+    return imap__lookup_from__(map->tree, _T_ROOT(map), x);
+}
+
+static inline void _table_seek(imap_t *map, imap_iter_t *iter, uint64_t x) {
+    imap__seek_from__(map->tree, iter, _T_ROOT(map), x);
+}
+
+static bool _imap_copy(imap_t *dst, imap_t *src, bool shared) {
+    imap_iter_t iter;
+    imap_pair_t pair;
+    *dst = *src;
+    dst->root = 0;
+    if (shared) {
+        // other versions live in the same block, so only what src reaches is copied, in key order
+        // so each leaf is filled through the finger
+        dst->count = 0;
+        if (!(dst->tree = _imap_ensure(NULL, (uint32_t)src->capacity)))
+            return false;
+        for (_table_seek(src, &iter, 0), pair = _imap_iterate(src->tree, &iter, 0); pair.slot; pair = _imap_iterate(src->tree, &iter, 0))
+            if (!_imap_set(dst, pair.x, _imap_getval64(src->tree, pair.slot))) {
+                IMAP_ALIGNED_FREE(dst->tree);
+                return false;
+            }
         return true;
     }
-    if (map->count + 1 >= map->capacity) {
+    if (!(dst->tree = (imap_node_t *)IMAP_ALIGNED_ALLOC(sizeof(imap_node_t), src->tree->vec32[imap__tree_size__])))
+        return false;
+    memcpy(dst->tree, src->tree, src->tree->vec32[imap__tree_mark__]);
+    return true;
+}
+
+static void _table_copy_entry(table_t *table, table_entry_t *copy, table_entry_t *entry, int flags) {
+    uint32_t storage;
+    *copy = *entry;
+    copy->flags |= ENTRY_FLAG_BLOCK;
+    if (flags & TABLE_CLONE_SHALLOW) {
+        copy->flags |= ENTRY_FLAG_BORROWED;
+        return;
+    }
+    copy->flags &= ~ENTRY_FLAG_BORROWED;
+    switch (entry->type) {
+        case ENTRY_STR:
+            if (entry->flags & ENTRY_FLAG_INLINE)
+                break;
+            copy->value = _table_str_store(table, (const char *)entry->value, &storage);
+            copy->flags = (copy->flags & ~ENTRY_FLAG_ARENA) | storage;
+            break;
+        case ENTRY_FLT:
+            copy->value = (uintptr_t)TABLE_MALLOC(sizeof(double));
+            *(double *)copy->value = *(double *)entry->value;
+            break;
+        default:
+            break;
+    }
+}
+
+// the trees are position independent and copied whole, the entry boxes all go into one
+// block filled in a single pass over the map
+static bool _table_copy(table_t *dst, table_t *src, int flags) {
+    imap_iter_t iter;
+    imap_pair_t pair;
+    table_entry_t *entries;
+    uint64_t value;
+    table_t copy = *src;
+    copy.snapshots = NULL;
+    copy.view = 0;
+    copy.block = NULL;
+    copy.journal = NULL;
+    copy.arena = NULL;
+    if (src->map.count && !(copy.block = TABLE_MALLOC(src->map.count * sizeof(table_entry_t))))
+        return false;
+    if (!_imap_copy(&copy.map, &src->map, !!src->snapshots)) {
+        TABLE_FREE(copy.block);
+        return false;
+    }
+    if (!_imap_copy(&copy.keys, &src->keys, !!src->snapshots)) {
+        IMAP_ALIGNED_FREE(copy.map.tree);
+        TABLE_FREE(copy.block);
+        return false;
+    }
+    entries = copy.block;
+    for (pair = _imap_iterate(copy.map.tree, &iter, 1); pair.slot; pair = _imap_iterate(copy.map.tree, &iter, 0)) {
+        _table_copy_entry(&copy, entries, _BOX(_imap_getval64(copy.map.tree, pair.slot)), flags);
+        _imap_setval64(copy.map.tree, pair.slot, (uintptr_t)entries++);
+    }
+    for (pair = _imap_iterate(copy.keys.tree, &iter, 1); pair.slot; pair = _imap_iterate(copy.keys.tree, &iter, 0)) {
+        value = _imap_getval64(copy.keys.tree, pair.slot);
+        if (flags & TABLE_CLONE_SHALLOW)
+            value |= _KEY_BORROWED;
+        else
+            value = (uintptr_t)strdup(_table_key_ptr(value));
+        _imap_setval64(copy.keys.tree, pair.slot, value);
+    }
+    *dst = copy;
+    _table_retain_block(dst);
+    return true;
+}
+
+// Snapshot views share the trees' blocks with their table and only read what their own roots
+// reach. Before a write the table copies the nodes on the key's path that the latest snapshot
+// can see (_table_privatise), and what it replaces is retired instead of freed until every view
+// that may see it has been released. The writer does the freeing on its next write, readers only
+// mark the table dirty, unless the table itself is gone.
+enum {
+    _RETIRED_NODE,          // + 1 for nodes of the keys tree
+    _RETIRED_CELL = 2,      // + 1 for cells of the keys tree
+    _RETIRED_ENTRY = 4,
+    _RETIRED_KEY,
+    _RETIRED_TREE,          // a block the trees have outgrown
+    _RETIRED_BLOCK          // the table's bulk entry block
+};
+
+typedef struct {
+    uint32_t seq, kind;
+    uint64_t ref;
+} _table_retired_t;
+
+struct table_snapshots {
+    pthread_mutex_t lock;
+    // ids of the views not yet released, guarded by lock like dirty and orphaned
+    uint32_t *live;
+    size_t nlive, maxlive;
+    bool dirty, orphaned;
+    // the rest belongs to the table's writer, or to the last view once the table is freed
+    uint32_t latest;
+    // per tree, its mark when the latest snapshot was taken (nodes and cells below it may be
+    // shared) and the free lists set aside so that new nodes land above it
+    uint32_t frozen[2], nfre[2], vfre[2];
+    _table_retired_t *retired;
+    size_t nretired, maxretired;
+    struct table_arena *arena;
+};
+
+static void _table_retire(struct table_snapshots *snapshots, uint32_t kind, uint64_t ref) {
+    _table_retired_t *grown;
+    size_t capacity;
+    if (snapshots->nretired == snapshots->maxretired) {
+        capacity = snapshots->maxretired ? snapshots->maxretired * 2 : 64;
+        // without room the item is leaked, freeing it could pull it from under a view
+        if (!(grown = TABLE_REALLOC(snapshots->retired, capacity * sizeof(_table_retired_t))))
+            return;
+        snapshots->retired = grown;
+        snapshots->maxretired = capacity;
+    }
+    snapshots->retired[snapshots->nretired++] = (_table_retired_t){snapshots->latest, kind, ref};
+}
+
+// free nodes link through their first word and free cells through the low half of their value.
+// A set-aside list is a stack of whole free lists, each head linking to the next list through its
+// second word or the high half of its value, so a snapshot sets a list aside in constant time
+#define _FREE_NEXT(tree, mark, cells)                                                                   \
+    ((cells) ? (uint32_t)(tree)->vec64[(mark) >> imap__slot_shift__] : *(uint32_t *)((uint8_t *)(tree) + (mark)))
+
+static void _table_stash(imap_node_t *tree, uint32_t *aside, uint32_t head, bool cells) {
+    if (!head)
+        return;
+    if (cells)
+        tree->vec64[head >> imap__slot_shift__] = (uint32_t)tree->vec64[head >> imap__slot_shift__] | (uint64_t)*aside << 32;
+    else
+        ((uint32_t *)((uint8_t *)tree + head))[1] = *aside;
+    *aside = head;
+}
+
+// put every list set aside at *aside back in front of the free list at *list
+static void _table_unstash(imap_node_t *tree, uint32_t *list, uint32_t *aside, bool cells) {
+    uint32_t head, next, last, link;
+    for (head = *aside; head; head = next) {
+        if (cells) {
+            next = (uint32_t)(tree->vec64[head >> imap__slot_shift__] >> 32);
+            tree->vec64[head >> imap__slot_shift__] &= UINT32_MAX;
+        } else
+            next = ((uint32_t *)((uint8_t *)tree + head))[1];
+        for (last = head; (link = _FREE_NEXT(tree, last, cells)); last = link);
+        if (cells)
+            tree->vec64[last >> imap__slot_shift__] = *list;
+        else
+            *(uint32_t *)((uint8_t *)tree + last) = *list;
+        *list = head;
+    }
+    *aside = 0;
+}
+
+// lowest id among the live views, UINT32_MAX without any
+static uint32_t _table_oldest(struct table_snapshots *snapshots) {
+    uint32_t oldest = UINT32_MAX;
+    size_t i;
+    for (i = 0; i < snapshots->nlive; i++)
+        if (snapshots->live[i] < oldest)
+            oldest = snapshots->live[i];
+    return oldest;
+}
+
+// hand a retired node or cell back to its tree, onto the lists set aside while a snapshot is frozen
+static void _table_unretire(table_t *table, _table_retired_t item) {
+    struct table_snapshots *snapshots = table->snapshots;
+    uint32_t which = item.kind & 1, mark = (uint32_t)item.ref;
+    imap_node_t *tree = which ? table->keys.tree : table->map.tree;
+    bool cells = item.kind >= _RETIRED_CELL, frozen = !!snapshots->frozen[which];
+    uint32_t *list = cells ? &tree->vec32[imap__tree_vfre__] : &tree->vec32[imap__tree_nfre__];
+    // set aside as a list of its own
+    uint32_t next = frozen ? 0 : *list;
+    if (cells)
+        tree->vec64[mark >> imap__slot_shift__] = next;
+    else
+        *(uint32_t *)((uint8_t *)tree + mark) = next;
+    if (frozen)
+        _table_stash(tree, cells ? &snapshots->vfre[which] : &snapshots->nfre[which], mark, cells);
+    else
+        *list = mark;
+}
+
+// free what no view older than below can see, entries before the blocks that may hold them
+static void _table_free_retired(table_t *table, uint32_t below) {
+    struct table_snapshots *snapshots = table->snapshots;
+    _table_retired_t item;
+    size_t i, kept;
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = kept = 0; i < snapshots->nretired; i++) {
+            item = snapshots->retired[i];
+            if (item.seq >= below || (!pass && item.kind >= _RETIRED_TREE)) {
+                snapshots->retired[kept++] = item;
+                continue;
+            }
+            switch (item.kind) {
+                case _RETIRED_NODE:
+                case _RETIRED_NODE + 1:
+                case _RETIRED_CELL:
+                case _RETIRED_CELL + 1:
+                    // an orphaned table's blocks are freed whole
+                    if (!snapshots->orphaned)
+                        _table_unretire(table, item);
+                    break;
+                case _RETIRED_ENTRY:
+                    _table_release(table, (table_entry_t *)(uintptr_t)item.ref);
+                    break;
+                case _RETIRED_KEY:
+                    _table_key_free(item.ref);
+                    break;
+                case _RETIRED_TREE:
+                    IMAP_ALIGNED_FREE((imap_node_t *)(uintptr_t)item.ref);
+                    break;
+                case _RETIRED_BLOCK:
+                    TABLE_FREE((void *)(uintptr_t)item.ref);
+                    break;
+            }
+        }
+        snapshots->nretired = kept;
+    }
+}
+
+static void _table_snapshots_destroy(struct table_snapshots *snapshots) {
+    pthread_mutex_destroy(&snapshots->lock);
+    TABLE_FREE(snapshots->live);
+    TABLE_FREE(snapshots->retired);
+    free(snapshots);
+}
+
+// on the writer, free what only released views could see. Once none is left the free lists
+// set aside come back and the table forgets about snapshots
+static void _table_reclaim(table_t *table) {
+    struct table_snapshots *snapshots = table->snapshots;
+    imap_node_t *tree;
+    uint32_t oldest;
+    int which;
+    pthread_mutex_lock(&snapshots->lock);
+    __atomic_store_n(&snapshots->dirty, false, __ATOMIC_RELAXED);
+    oldest = _table_oldest(snapshots);
+    pthread_mutex_unlock(&snapshots->lock);
+    _table_free_retired(table, oldest);
+    if (oldest != UINT32_MAX)
+        return;
+    for (which = 0; which < 2; which++) {
+        tree = which ? table->keys.tree : table->map.tree;
+        _table_unstash(tree, &tree->vec32[imap__tree_nfre__], &snapshots->nfre[which], false);
+        _table_unstash(tree, &tree->vec32[imap__tree_vfre__], &snapshots->vfre[which], true);
+    }
+    _table_snapshots_destroy(snapshots);
+    table->snapshots = NULL;
+}
+
+// whether a view may still see the box in slot: it was reached through a copied leaf, or its
+// cell is older than the latest snapshot
+static bool _table_box_shared(table_t *table, uint32_t *slot) {
+    struct table_snapshots *snapshots = table->snapshots;
+    if (!snapshots || !__atomic_load_n(&snapshots->nlive, __ATOMIC_ACQUIRE))
+        return false;
+    return (_imap_getval64(table->map.tree, slot) & _SHARED) ||
+        (*slot >> imap__slot_shift__) * sizeof(uint64_t) < snapshots->frozen[0];
+}
+
+// release the entry in slot, or retire it while a view may still see it
+static void _table_discard(table_t *table, uint32_t *slot) {
+    table_entry_t *entry = _BOX(_imap_getval64(table->map.tree, slot));
+    if (_table_box_shared(table, slot))
+        _table_retire(table->snapshots, _RETIRED_ENTRY, (uintptr_t)entry);
+    else
+        _table_release(table, entry);
+}
+
+static void _table_discard_key(table_t *table, uint64_t value) {
+    if (table->snapshots && __atomic_load_n(&table->snapshots->nlive, __ATOMIC_ACQUIRE))
+        _table_retire(table->snapshots, _RETIRED_KEY, value);
+    else
+        _table_key_free(value);
+}
+
+// the entry in slot, copied first if a view may still see it so the caller can change it in place
+static table_entry_t* _table_own(table_t *table, uint32_t *slot) {
+    uint64_t value = _imap_getval64(table->map.tree, slot);
+    table_entry_t *entry = _BOX(value), *copy;
+    if (!(value & _SHARED))
+        return entry;
+    if (_table_box_shared(table, slot)) {
+        if (!(copy = TABLE_MALLOC(sizeof(table_entry_t))))
+            return NULL;
+        _table_copy_entry(table, copy, entry, 0);
+        copy->flags &= ~ENTRY_FLAG_BLOCK;
+        _table_retire(table->snapshots, _RETIRED_ENTRY, (uintptr_t)entry);
+        entry = copy;
+    }
+    _imap_setval64(table->map.tree, slot, (uintptr_t)entry);
+    return entry;
+}
+
+// room for a path copy and the write after it. A tree that has to grow moves to a block the
+// views don't see, where nothing is shared anymore: what was retired in it is free again and
+// the boxes from before the freeze are tagged instead
+static bool _table_reserve(table_t *table, int which) {
+    struct table_snapshots *snapshots = table->snapshots;
+    imap_t *map = which ? &table->keys : &table->map;
+    imap_node_t *tree = map->tree, *grown;
+    imap_iter_t iter;
+    imap_pair_t pair;
+    uint32_t frozen = snapshots->frozen[which], sval;
+    _table_retired_t item;
+    size_t i, kept;
+    bool full = map->count + 1 >= map->capacity;
+    // up to 16 nodes and two nodes of cells for the path, three more for the write
+    if (!full && tree->vec32[imap__tree_mark__] + 24 * sizeof(imap_node_t) <= tree->vec32[imap__tree_size__])
+        return true;
+    if (!(grown = imap__grow__(tree, (uint32_t)(full ? map->capacity * 2 : 16))))
+        return false;
+    if (full)
         map->capacity *= 2;
-        map->tree = _imap_ensure(map->tree, map->capacity);
+    if (grown == tree)
+        return true;
+    map->tree = grown;
+    snapshots->frozen[which] = 0;
+    _table_unstash(grown, &grown->vec32[imap__tree_nfre__], &snapshots->nfre[which], false);
+    _table_unstash(grown, &grown->vec32[imap__tree_vfre__], &snapshots->vfre[which], true);
+    for (i = kept = 0; i < snapshots->nretired; i++) {
+        item = snapshots->retired[i];
+        if (item.kind < _RETIRED_ENTRY && (item.kind & 1) == (uint32_t)which)
+            _table_unretire(table, item);
+        else
+            snapshots->retired[kept++] = item;
+    }
+    snapshots->nretired = kept;
+    if (!which)
+        for (pair = _imap_iterate(grown, &iter, 1); pair.slot; pair = _imap_iterate(grown, &iter, 0))
+            if (((sval = *pair.slot) >> imap__slot_shift__) * sizeof(uint64_t) < frozen)
+                grown->vec64[sval >> imap__slot_shift__] |= _SHARED;
+    _table_retire(snapshots, _RETIRED_TREE, (uintptr_t)tree);
+    return true;
+}
+
+// copy the nodes on x's path that the latest snapshot can see, so the write that follows only
+// changes nodes of the table's own version. Copied leaves get their own cells
+static bool _table_privatise(table_t *table, int which, uint64_t x) {
+    struct table_snapshots *snapshots = table->snapshots;
+    imap_node_t *tree, *node, *copy;
+    uint32_t *slot, sval, mark, newmark, dirn, fngr, frozen;
+    uint64_t value;
+    if (!snapshots || !snapshots->frozen[which])
+        return true;
+    if (!_table_reserve(table, which))
+        return false;
+    if (!(frozen = snapshots->frozen[which]))
+        return true;
+    tree = which ? table->keys.tree : table->map.tree;
+    slot = &tree->vec32[imap__tree_root__];
+    while ((sval = *slot) & imap__slot_node__) {
+        node = imap__node__(tree, mark = sval & imap__slot_value__);
+        if (mark < frozen) {
+            newmark = imap__alloc_node__(tree);
+            copy = imap__node__(tree, newmark);
+            *copy = *node;
+            if (!imap__node_pos__(copy))
+                for (dirn = 0; dirn < 16; dirn++)
+                    if (copy->vec32[dirn] & imap__slot_value__) {
+                        value = _imap_getval64(tree, &copy->vec32[dirn]);
+                        _table_retire(snapshots, _RETIRED_CELL + which, copy->vec32[dirn] & imap__slot_value__);
+                        copy->vec32[dirn] &= imap__slot_pmask__;
+                        _imap_setval64(tree, &copy->vec32[dirn], which ? value : value | _SHARED);
+                    }
+            _table_retire(snapshots, _RETIRED_NODE + which, mark);
+            if (((fngr = imap__finger__(tree)) & ~0x3f) == mark)
+                imap__set_finger__(tree, newmark | (fngr & 0x3f));
+            *slot = (sval & ~imap__slot_value__) | newmark;
+            node = copy;
+        }
+        if (!imap__node_pos__(node))
+            break;
+        slot = &node->vec32[imap__xdir__(x, imap__node_pos__(node))];
+    }
+    return true;
+}
+
+// called before any mutation. A view becomes an independent copy, the table itself frees
+// what released views kept alive
+static bool _table_detach(table_t *table) {
+    struct table_snapshots *snapshots = table->snapshots;
+    table_t copy;
+    if (!snapshots)
+        return true;
+    if (!table->view) {
+        if (__atomic_load_n(&snapshots->dirty, __ATOMIC_ACQUIRE))
+            _table_reclaim(table);
+        return true;
+    }
+    if (!_table_copy(&copy, table, 0))
+        return false;
+    table_free(table);
+    *table = copy;
+    return true;
+}
+
+table_t table_snapshot(table_t *table) {
+    struct table_snapshots *snapshots;
+    imap_node_t *tree;
+    uint32_t *grown;
+    table_t snapshot = {0};
+    int which;
+    if (!table->view && !_table_detach(table))
+        return snapshot;
+    if (!(snapshots = table->snapshots)) {
+        if (!(snapshots = calloc(1, sizeof(struct table_snapshots))))
+            return snapshot;
+        pthread_mutex_init(&snapshots->lock, NULL);
+        table->snapshots = snapshots;
+    }
+    pthread_mutex_lock(&snapshots->lock);
+    if (snapshots->nlive == snapshots->maxlive) {
+        size_t capacity = snapshots->maxlive ? snapshots->maxlive * 2 : 4;
+        if (!(grown = TABLE_REALLOC(snapshots->live, capacity * sizeof(uint32_t)))) {
+            pthread_mutex_unlock(&snapshots->lock);
+            return snapshot;
+        }
+        snapshots->live = grown;
+        snapshots->maxlive = capacity;
+    }
+    snapshot = *table;
+    snapshot.journal = NULL;
+    snapshot.arena = NULL;
+    _table_retain_block(&snapshot);
+    if (!table->view) {
+        // new nodes and cells come from above the mark, so everything below it stays as it is
+        snapshot.view = ++snapshots->latest;
+        for (which = 0; which < 2; which++) {
+            tree = which ? table->keys.tree : table->map.tree;
+            _table_stash(tree, &snapshots->nfre[which], tree->vec32[imap__tree_nfre__], false);
+            _table_stash(tree, &snapshots->vfre[which], tree->vec32[imap__tree_vfre__], true);
+            tree->vec32[imap__tree_nfre__] = tree->vec32[imap__tree_vfre__] = 0;
+            snapshots->frozen[which] = tree->vec32[imap__tree_mark__];
+        }
+        snapshot.map.root = table->map.tree->vec32[imap__tree_root__] | 1;
+        snapshot.keys.root = table->keys.tree->vec32[imap__tree_root__] | 1;
+    }
+    snapshots->live[snapshots->nlive] = snapshot.view;
+    __atomic_store_n(&snapshots->nlive, snapshots->nlive + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&snapshots->lock);
+    return snapshot;
+}
+
+// a view drops out under the lock. The table frees what it kept alive on its next write, or, if
+// the table is gone, the views clean up after each other
+static void _table_release_view(table_t *view) {
+    struct table_snapshots *snapshots = view->snapshots;
+    table_t owner = {.snapshots = snapshots};
+    size_t i;
+    bool last;
+    pthread_mutex_lock(&snapshots->lock);
+    for (i = 0; i < snapshots->nlive && snapshots->live[i] != view->view; i++);
+    if (i < snapshots->nlive) {
+        snapshots->live[i] = snapshots->live[snapshots->nlive - 1];
+        __atomic_store_n(&snapshots->nlive, snapshots->nlive - 1, __ATOMIC_RELEASE);
+    }
+    if (!snapshots->orphaned) {
+        __atomic_store_n(&snapshots->dirty, true, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&snapshots->lock);
+        return;
+    }
+    owner.arena = snapshots->arena;
+    _table_free_retired(&owner, _table_oldest(snapshots));
+    last = !snapshots->nlive;
+    pthread_mutex_unlock(&snapshots->lock);
+    if (last) {
+        _table_arena_destroy(snapshots->arena);
+        _table_snapshots_destroy(snapshots);
+    }
+}
+
+// table_free with views still alive: entries only the table sees are released now, the rest of
+// its storage is left to the views
+static bool _table_orphan(table_t *table) {
+    struct table_snapshots *snapshots = table->snapshots;
+    imap_iter_t iter;
+    imap_pair_t pair;
+    pthread_mutex_lock(&snapshots->lock);
+    if (!snapshots->nlive) {
+        pthread_mutex_unlock(&snapshots->lock);
+        _table_reclaim(table);
+        return false;
+    }
+    for (pair = _imap_iterate(table->map.tree, &iter, 1); pair.slot; pair = _imap_iterate(table->map.tree, &iter, 0))
+        _table_discard(table, pair.slot);
+    for (pair = _imap_iterate(table->keys.tree, &iter, 1); pair.slot; pair = _imap_iterate(table->keys.tree, &iter, 0))
+        _table_retire(snapshots, _RETIRED_KEY, _imap_getval64(table->keys.tree, pair.slot));
+    _table_retire(snapshots, _RETIRED_TREE, (uintptr_t)table->map.tree);
+    _table_retire(snapshots, _RETIRED_TREE, (uintptr_t)table->keys.tree);
+    if (table->block)
+        _table_retire(snapshots, _RETIRED_BLOCK, (uintptr_t)table->block);
+    snapshots->arena = table->arena;
+    snapshots->orphaned = true;
+    pthread_mutex_unlock(&snapshots->lock);
+    return true;
+}
+
+bool table_clone(table_t *src, table_t *dst, int flags) {
+    // these drop entries without being asked to
+    if ((flags & TABLE_CLONE_SHALLOW) && (_CACHED(src) || src->expiring || src->view))
+        return false;
+    return _table_copy(dst, src, flags);
+}
+
+struct table_journal {
+    FILE *file;
+    char *path;
+    size_t pending;
+    // set from any thread journaling through table_incr_atomic
+    bool failed;
+};
+
+#define _JOURNAL_FAIL(journal)      (__atomic_store_n(&(journal)->failed, true, __ATOMIC_RELAXED))
+#define _JOURNAL_FAILED(journal)    (__atomic_load_n(&(journal)->failed, __ATOMIC_RELAXED))
+
+enum {
+    _JOURNAL_SET = 1,
+    _JOURNAL_DEL,
+    _JOURNAL_INCR
+};
+
+// followed by key_len bytes of key string and value_len bytes of string value, in host byte order.
+// crc is the CRC-32C of the record (crc itself zeroed) and both strings
+typedef struct {
+    uint8_t op, type;
+    uint16_t reserved;
+    uint32_t crc;
+    uint32_t expires;
+    uint32_t key_len, value_len;
+    uint32_t padding;
+    uint64_t key, value;
+} _table_record_t;
+
+static uint32_t _table_crc32c(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *bytes = (const uint8_t *)data;
+#if defined(__SSE4_2__) && !defined(_MSC_VER)
+    uint64_t word;
+    for (; len >= 8; bytes += 8, len -= 8) {
+        memcpy(&word, bytes, sizeof(word));
+        crc = (uint32_t)__builtin_ia32_crc32di(crc, word);
+    }
+    for (; len; len--)
+        crc = __builtin_ia32_crc32qi(crc, *bytes++);
+#else
+    // a nibble at a time, records are short enough that a 1KB table isn't worth the cache lines
+    static const uint32_t nibbles[16] = {
+        0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1, 0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+        0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9, 0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75
+    };
+    for (; len; len--) {
+        crc ^= *bytes++;
+        crc = (crc >> 4) ^ nibbles[crc & 15];
+        crc = (crc >> 4) ^ nibbles[crc & 15];
+    }
+#endif
+    return crc;
+}
+
+static uint32_t _table_record_crc(_table_record_t *record, const char *key, const char *value) {
+    uint32_t crc = record->crc, result;
+    record->crc = 0;
+    result = _table_crc32c(0xffffffff, record, sizeof(_table_record_t));
+    result = _table_crc32c(result, key, record->key_len);
+    result = ~_table_crc32c(result, value, record->value_len);
+    record->crc = crc;
+    return result;
+}
+
+static const char* _table_key_of(table_t *table, uint64_t key) {
+    uint32_t *slot = table->keys.count ? _table_lookup(&table->keys, key) : NULL;
+    return slot ? _table_key_ptr(_imap_getval64(table->keys.tree, slot)) : NULL;
+}
+
+static void _table_journal_append(struct table_journal *journal, _table_record_t *record, const char *key, const char *value) {
+    // records without strings are a single fwrite, so table_incr_atomic can journal from any thread
+    record->crc = _table_record_crc(record, key, value);
+    if (fwrite(record, sizeof(_table_record_t), 1, journal->file) != 1 ||
+        (record->key_len && fwrite(key, record->key_len, 1, journal->file) != 1) ||
+        (record->value_len && fwrite(value, record->value_len, 1, journal->file) != 1))
+        _JOURNAL_FAIL(journal);
+}
+
+// append and sync once a batch is complete
+static void _table_journal_write(struct table_journal *journal, _table_record_t *record, const char *key, const char *value) {
+    _table_journal_append(journal, record, key, value);
+    if (__atomic_add_fetch(&journal->pending, 1, __ATOMIC_RELAXED) >= TABLE_JOURNAL_BATCH) {
+        __atomic_store_n(&journal->pending, 0, __ATOMIC_RELAXED);
+        if (fflush(journal->file) || fsync(fileno(journal->file)))
+            _JOURNAL_FAIL(journal);
+    }
+}
+
+// the set record for entry, returns its string value (NULL if it has none)
+static const char* _table_journal_record(table_t *table, uint64_t key, table_entry_t *entry, _table_record_t *record, const char **key_str) {
+    const char *value = NULL;
+    *record = (_table_record_t){.op = _JOURNAL_SET, .type = entry->type, .expires = entry->expires, .key = key};
+    switch (entry->type) {
+        case ENTRY_STR:
+            if ((value = table_entry_str(entry)))
+                record->value_len = (uint32_t)strlen(value);
+            break;
+        case ENTRY_FLT:
+            memcpy(&record->value, (double *)entry->value, sizeof(double));
+            break;
+        default:
+            record->value = entry->value;
+            break;
+    }
+    if ((*key_str = _table_key_of(table, key)))
+        record->key_len = (uint32_t)strlen(*key_str);
+    return value;
+}
+
+static void _table_journal_put(table_t *table, uint64_t key, table_entry_t *entry) {
+    _table_record_t record;
+    const char *key_str, *value = _table_journal_record(table, key, entry, &record, &key_str);
+    _table_journal_write(table->journal, &record, key_str, value);
+}
+
+static void _table_journal_op(table_t *table, int op, uint64_t key, uint64_t value) {
+    _table_record_t record = {.op = (uint8_t)op, .key = key, .value = value};
+    _table_journal_write(table->journal, &record, NULL, NULL);
+}
+
+static bool _table_remove(table_t *table, uint64_t key, table_entry_t *entry) {
+    uint32_t *slot;
+    if (!_table_privatise(table, 0, key))
+        return false;
+    if (table->journal)
+        _table_journal_op(table, _JOURNAL_DEL, key, 0);
+    if (table->cache.max_bytes)
+        table->cache.bytes -= _table_entry_size(entry);
+    if (entry->expires)
+        table->expiring--;
+    _table_discard(table, _imap_lookup(table->map.tree, key));
+    _imap_remove(table->map.tree, key);
+    table->map.count--;
+    // a key string that can't be unlinked is left behind, it only names a missing key
+    if (_table_privatise(table, 1, key) && (slot = _imap_lookup(table->keys.tree, key))) {
+        _table_discard_key(table, _imap_getval64(table->keys.tree, slot));
+        _imap_remove(table->keys.tree, key);
+        table->keys.count--;
+    }
+    return true;
+}
+
+// CLOCK sweep from the hand, clearing reference bits until an unreferenced entry is found
+static bool _table_evict(table_t *table, const uint64_t *keep) {
+    imap_iter_t iter;
+    imap_pair_t pair;
+    table_entry_t *entry;
+    uint32_t *slot;
+    int wraps = 0;
+    _imap_seek(table->map.tree, &iter, table->cache.hand);
+    for (;;) {
+        pair = _imap_iterate(table->map.tree, &iter, 0);
+        if (!pair.slot) {
+            if (wraps++ == 2)
+                return false;
+            _imap_seek(table->map.tree, &iter, 0);
+            continue;
+        }
+        if (keep && *keep == pair.x)
+            continue;
+        entry = _BOX(_imap_getval64(table->map.tree, pair.slot));
+        if (!__atomic_load_n(&entry->ref, __ATOMIC_RELAXED))
+            break;
+        __atomic_store_n(&entry->ref, 0, __ATOMIC_RELAXED);
+    }
+    table->cache.hand = pair.x + 1;
+    if (table->cache.evict || table->cache.evict_block) {
+        const char *key_str = NULL;
+        if ((slot = _imap_lookup(table->keys.tree, pair.x)))
+            key_str = _table_key_ptr(_imap_getval64(table->keys.tree, slot));
+        if (table->cache.evict)
+            table->cache.evict(table, pair.x, key_str, entry, table->cache.userdata);
+        else
+            ((void(^)(table_t*, uint64_t, const char*, table_entry_t*, void*))table->cache.evict_block)(table, pair.x, key_str, entry, table->cache.userdata);
     }
-    if (!(slot = imap_assign(map->tree, key)))
+    return _table_remove(table, pair.x, entry);
+}
+
+static void _table_shrink(table_t *table, const uint64_t *keep) {
+    while ((table->cache.max_entries && table->map.count > table->cache.max_entries) ||
+           (table->cache.max_bytes && table->cache.bytes > table->cache.max_bytes))
+        if (!_table_evict(table, keep))
+            break;
+}
+
+// account for a written entry (previously `before` bytes) and evict if over budget,
+// new entries start unreferenced so one-off keys are the first to go
+static void _table_touch(table_t *table, uint64_t key, table_entry_t *entry, size_t before, bool exists) {
+    if (exists)
+        __atomic_store_n(&entry->ref, 1, __ATOMIC_RELAXED);
+    if (table->cache.max_bytes)
+        table->cache.bytes += _table_entry_size(entry) - before;
+    _table_shrink(table, &key);
+}
+
+static bool _table_cache(table_t *table, size_t max_entries, size_t max_bytes, void *userdata) {
+    imap_iter_t iter;
+    imap_pair_t pair;
+    if (!_table_detach(table))
         return false;
-    imap_setval64(map->tree, slot, value);
-    map->count++;
+    _table_release_block(table);
+    table->cache.max_entries = max_entries;
+    table->cache.max_bytes = max_bytes;
+    table->cache.evict = NULL;
+    table->cache.userdata = userdata;
+    table->cache.bytes = 0;
+    if (max_bytes)
+        for (pair = _imap_iterate(table->map.tree, &iter, 1); pair.slot; pair = _imap_iterate(table->map.tree, &iter, 0))
+            table->cache.bytes += _table_entry_size(_BOX(_imap_getval64(table->map.tree, pair.slot)));
     return true;
 }
 
+void _table_cache_fn(table_t *table, size_t max_entries, size_t max_bytes, void(*callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata) {
+    if (!_table_cache(table, max_entries, max_bytes, userdata))
+        return;
+    table->cache.evict = callback;
+    _table_shrink(table, NULL);
+}
+
+void _table_cache_block(table_t *table, size_t max_entries, size_t max_bytes, void(^callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata) {
+    if (!_table_cache(table, max_entries, max_bytes, userdata))
+        return;
+    if (callback)
+        table->cache.evict_block = (void *)Block_copy(callback);
+    _table_shrink(table, NULL);
+}
+
 bool _table_set_int(table_t *table, uint64_t key, uint64_t value) {
-    return imap_set(&table->map, key, value);
+    if (!_table_detach(table) || !_table_privatise(table, 0, key))
+        return false;
+    uint32_t *slot = _imap_slot(&table->map, key);
+    if (!slot)
+        return false;
+    bool exists = !!(*slot & imap__slot_value__);
+    if (exists) {
+        table_entry_t *entry = _BOX(_imap_getval64(table->map.tree, slot));
+        if (table->cache.max_bytes)
+            table->cache.bytes -= _table_entry_size(entry);
+        if (entry->expires)
+            table->expiring--;
+        _table_discard(table, slot);
+    } else
+        table->map.count++;
+    _imap_setval64(table->map.tree, slot, value);
+    if (((table_entry_t *)value)->expires)
+        table->expiring++;
+    if (table->journal)
+        _table_journal_put(table, key, (table_entry_t *)value);
+    if (_CACHED(table))
+        _table_touch(table, key, (table_entry_t *)value, 0, exists);
+    return true;
 }
 
 #define _HASH(T, STR) (!(T)->hashfn ? -1LL : (T)->hashfn((void*)(STR), strlen((STR)), (T)->seed))
 
-bool _table_set_str(table_t *table, const char *key, uint64_t value) {
+static void _table_key_put(table_t *table, uint64_t key_int, const char *key) {
+    if (_table_detach(table) && !_imap_lookup(table->keys.tree, key_int) && _table_privatise(table, 1, key_int))
+        _imap_set(&table->keys, key_int, (uintptr_t)strdup(key));
+}
+
+uint64_t _table_key_str(table_t *table, const char *key) {
     uint64_t key_int = _HASH(table, key);
-    imap_set(&table->keys, key_int, (uintptr_t)strdup(key));
+    _table_key_put(table, key_int, key);
+    return key_int;
+}
+
+bool _table_set_str(table_t *table, const char *key, uint64_t value) {
+    uint64_t key_int = _table_key_str(table, key);
     return key_int == (uintptr_t)NULL ? false : _table_set_int(table, key_int, value);
 }
 
@@ -806,11 +2180,18 @@ bool _table_set_void(table_t *table, void *key, uint64_t value) {
 }
 
 int _table_get(table_t *table, uint64_t key, uint64_t *val) {
-    uint32_t *slot = imap_lookup(table->map.tree, key);
+    uint32_t *slot = _table_lookup(&table->map, key);
     if (!slot)
         return 0;
+    uint64_t value = (uintptr_t)_BOX(_imap_getval64(table->map.tree, slot));
+    if (table->expiring && _table_expired((table_entry_t *)value, _NOW()))
+        return 0;
+    // views don't evict, and their entries may be shared with the table
+    // test first so hot entries don't bounce the cache line between readers
+    if (_CACHED(table) && !table->view && !__atomic_load_n(&((table_entry_t *)value)->ref, __ATOMIC_RELAXED))
+        __atomic_fetch_or(&((table_entry_t *)value)->ref, 1, __ATOMIC_RELAXED);
     if (val)
-        *val = imap_getval64(table->map.tree, slot);
+        *val = value;
     return 1;
 }
 
@@ -827,67 +2208,539 @@ uint64_t _table_get_void(table_t *table, void *key) {
 }
 
 bool _table_has(table_t *table, uint64_t key) {
-    return imap_lookup(table->map.tree, key) != NULL;
+    uint32_t *slot = _table_lookup(&table->map, key);
+    if (!slot)
+        return false;
+    return !table->expiring || !_table_expired(_BOX(_imap_getval64(table->map.tree, slot)), _NOW());
 }
 
 bool _table_del(table_t *table, uint64_t key) {
     uint64_t value = 0;
-    if (!_table_get(table, key, &value))
+    if (!_table_detach(table) || !_table_get(table, key, &value))
         return false;
-    table_entry_t *entry = (table_entry_t *)value;
-    if (entry != NULL) {
-        if (entry->type == ENTRY_STR || entry->type == ENTRY_FLT)
-            free((void*)entry->value);
-        free(entry);
+    return _table_remove(table, key, (table_entry_t *)value);
+}
+
+static table_entry_t* _table_upsert(table_t *table, uint64_t key, bool *exists) {
+    if (!_table_detach(table) || !_table_privatise(table, 0, key))
+        return NULL;
+    uint32_t *slot = _imap_slot(&table->map, key);
+    if (!slot)
+        return NULL;
+    if ((*exists = !!(*slot & imap__slot_value__))) {
+        table_entry_t *entry = _table_own(table, slot);
+        if (!entry || !entry->expires || !_table_expired(entry, _NOW()))
+            return entry;
+        // an expired entry is reused as if the key was missing
+        if (table->cache.max_bytes)
+            table->cache.bytes -= _table_entry_size(entry);
+        _table_drop_payload(table, entry);
+        *entry = (table_entry_t){.type = ENTRY_INT, .flags = entry->flags};
+        table->expiring--;
+        *exists = false;
+        return entry;
     }
-    imap_remove(table->map.tree, key);
-    table->map.count--;
+    table_entry_t *entry = (table_entry_t *)_table_int_to_int(table, 0);
+    _imap_setval64(table->map.tree, slot, (uintptr_t)entry);
+    table->map.count++;
+    return entry;
+}
+
+int64_t _table_incr(table_t *table, uint64_t key, int64_t delta) {
+    bool exists;
+    table_entry_t *entry = _table_upsert(table, key, &exists);
+    if (!entry)
+        return 0;
+    size_t before = exists && table->cache.max_bytes ? _table_entry_size(entry) : 0;
+    if (entry->type != ENTRY_INT) {
+        _table_drop_payload(table, entry);
+        entry->type = ENTRY_INT;
+        entry->value = 0;
+    }
+    int64_t result = (int64_t)(entry->value += (uint64_t)delta);
+    if (table->journal)
+        _table_journal_put(table, key, entry);
+    if (_CACHED(table))
+        _table_touch(table, key, entry, before, exists);
+    return result;
+}
+
+bool _table_set_ttl(table_t *table, uint64_t key, uint64_t value, uint32_t ttl) {
+    ((table_entry_t *)value)->expires = ttl ? _NOW() + ttl : 0;
+    return _table_set_int(table, key, value);
+}
+
+void table_finger(table_t *table, bool enable) {
+    _imap_finger(table->map.tree, enable);
+    _imap_finger(table->keys.tree, enable);
+}
+
+size_t table_expire(table_t *table, size_t budget) {
+    imap_iter_t iter;
+    imap_pair_t pair;
+    table_entry_t *entry;
+    size_t removed = 0;
+    if (!table->expiring || !_table_detach(table))
+        return 0;
+    uint32_t now = _NOW();
+    _imap_seek(table->map.tree, &iter, table->expire_hand);
+    while (budget-- && table->expiring) {
+        pair = _imap_iterate(table->map.tree, &iter, 0);
+        if (!pair.slot) {
+            table->expire_hand = 0;
+            _imap_seek(table->map.tree, &iter, 0);
+            continue;
+        }
+        table->expire_hand = pair.x + 1;
+        entry = _BOX(_imap_getval64(table->map.tree, pair.slot));
+        if (!_table_expired(entry, now))
+            continue;
+        _table_remove(table, pair.x, entry);
+        removed++;
+        // removal may free nodes on the iterator stack
+        _imap_seek(table->map.tree, &iter, table->expire_hand);
+    }
+    return removed;
+}
+
+bool _table_incr_atomic(table_t *table, uint64_t key, int64_t delta, int64_t *result) {
+    // a view's entries are read-only, and one the table still shares with a view must be copied first
+    uint32_t *slot = table->view ? NULL : _table_peek(&table->map, key);
+    if (!slot || _table_box_shared(table, slot))
+        return false;
+    table_entry_t *entry = _BOX(_imap_getval64(table->map.tree, slot));
+    // anything but a live integer would need the entry rewritten, which only table_incr may do
+    if (entry->type != ENTRY_INT || (table->expiring && _table_expired(entry, _NOW())))
+        return false;
+    // concurrent increments may reach the journal in any order, so only the delta is recorded
+    if (table->journal)
+        _table_journal_op(table, _JOURNAL_INCR, key, (uint64_t)delta);
+    int64_t value = (int64_t)__atomic_add_fetch(&entry->value, (uint64_t)delta, __ATOMIC_RELAXED);
+    if (result)
+        *result = value;
+    return true;
+}
+
+bool _table_upsert_fn(table_t *table, uint64_t key, void(*callback)(table_t*, uint64_t, table_entry_t*, bool, void*), void *userdata) {
+    bool exists;
+    table_entry_t *entry = _table_upsert(table, key, &exists);
+    if (!entry)
+        return false;
+    size_t before = exists && table->cache.max_bytes ? _table_entry_size(entry) : 0;
+    callback(table, key, entry, exists, userdata);
+    if (table->journal)
+        _table_journal_put(table, key, entry);
+    if (_CACHED(table))
+        _table_touch(table, key, entry, before, exists);
+    return true;
+}
+
+bool _table_upsert_block(table_t *table, uint64_t key, void(^callback)(table_t*, uint64_t, table_entry_t*, bool, void*), void *userdata) {
+    bool exists;
+    table_entry_t *entry = _table_upsert(table, key, &exists);
+    if (!entry)
+        return false;
+    size_t before = exists && table->cache.max_bytes ? _table_entry_size(entry) : 0;
+    callback(table, key, entry, exists, userdata);
+    if (table->journal)
+        _table_journal_put(table, key, entry);
+    if (_CACHED(table))
+        _table_touch(table, key, entry, before, exists);
     return true;
 }
 
 void table_free(table_t *table) {
+    imap_iter_t iter;
+    imap_pair_t pair;
+    table_journal_close(table);
+    _table_release_block(table);
+    if (table->view)
+        _table_release_view(table);
+    if (table->view || (table->snapshots && _table_orphan(table))) {
+        memset(table, 0, sizeof(table_t));
+        return;
+    }
     if (table->map.tree) {
-        table_each(table, NULL, ^(table_t *table, uint64_t key, const char *key_str, table_entry_t *entry, void *userdata) {
-            if (entry->type == ENTRY_STR || entry->type == ENTRY_FLT)
-                free((void*)entry->value);
-        });
+        pair = _imap_iterate(table->map.tree, &iter, 1);
+        while (pair.slot) {
+            _table_release(table, _BOX(_imap_getval64(table->map.tree, pair.slot)));
+            pair = _imap_iterate(table->map.tree, &iter, 0);
+        }
         IMAP_ALIGNED_FREE(table->map.tree);
-        imap_iter_t iter;
-        imap_pair_t pair = imap_iterate(table->keys.tree, &iter, 1);
+    }
+    _table_arena_destroy(table->arena);
+    if (table->keys.tree) {
+        pair = _imap_iterate(table->keys.tree, &iter, 1);
         while (pair.slot) {
-            uint64_t value = 0;
-            _table_get(table, pair.x, &value);
-            free((void*)value);
-            pair = imap_iterate(table->keys.tree, &iter, 0);
+            _table_key_free(_imap_getval64(table->keys.tree, pair.slot));
+            pair = _imap_iterate(table->keys.tree, &iter, 0);
         }
         IMAP_ALIGNED_FREE(table->keys.tree);
     }
+    TABLE_FREE(table->block);
     memset(table, 0, sizeof(table_t));
 }
 
-#define _T_ITER(T, CB, UD)                                                 \
+// VALID is the length of the complete records, the replay only succeeds if nothing follows them
+// but a record cut short by the end of the file (a write torn by a crash)
+static bool _table_journal_replay(table_t *table, const char *path, long *valid) {
+    _table_record_t record;
+    char *strings = NULL, *grown;
+    size_t capacity = 0;
+    uint64_t value;
+    double number;
+    bool complete = false;
+    FILE *file = fopen(path, "rb");
+    *valid = 0;
+    if (!file)
+        return errno == ENOENT;
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+    // replayed changes must not be journaled again
+    struct table_journal *journal = table->journal;
+    table->journal = NULL;
+    for (;;) {
+        if (fread(&record, 1, sizeof(_table_record_t), file) != sizeof(_table_record_t)) {
+            complete = feof(file) && !ferror(file);
+            break;
+        }
+        if (record.op < _JOURNAL_SET || record.op > _JOURNAL_INCR || record.type > ENTRY_PTR)
+            break;
+        if ((size_t)record.key_len + record.value_len + 2 > capacity) {
+            capacity = (size_t)record.key_len + record.value_len + 2;
+            if (!(grown = TABLE_REALLOC(strings, capacity)))
+                break;
+            strings = grown;
+        }
+        if ((record.key_len && fread(strings, record.key_len, 1, file) != 1) ||
+            (record.value_len && fread(strings + record.key_len + 1, record.value_len, 1, file) != 1)) {
+            complete = feof(file) && !ferror(file);
+            break;
+        }
+        if (record.crc != _table_record_crc(&record, strings, strings + record.key_len + 1))
+            break;
+        strings[record.key_len] = strings[record.key_len + record.value_len + 1] = '\0';
+        switch (record.op) {
+            case _JOURNAL_SET:
+                // keys arrive hashed, so only the key string needs registering
+                if (record.key_len)
+                    _table_key_put(table, record.key, strings);
+                switch (record.type) {
+                    case ENTRY_STR:
+                        value = _table_str_to_int(table, strings + record.key_len + 1);
+                        break;
+                    case ENTRY_FLT:
+                        memcpy(&number, &record.value, sizeof(double));
+                        value = _table_flt_to_int(table, number);
+                        break;
+                    default:
+                        value = _table_int_to_int(table, record.value);
+                        ((table_entry_t *)value)->type = (table_entry_type)record.type;
+                        break;
+                }
+                ((table_entry_t *)value)->expires = record.expires;
+                _table_set_int(table, record.key, value);
+                break;
+            case _JOURNAL_DEL:
+                _table_del(table, record.key);
+                break;
+            case _JOURNAL_INCR:
+                _table_incr(table, record.key, (int64_t)record.value);
+                break;
+        }
+        *valid += (long)(sizeof(_table_record_t) + record.key_len + record.value_len);
+    }
+    TABLE_FREE(strings);
+    fclose(file);
+    table->journal = journal;
+    return complete;
+}
+
+bool table_journal_replay(table_t *table, const char *path) {
+    long valid;
+    return _table_journal_replay(table, path, &valid);
+}
+
+static FILE* _table_journal_file(const char *path, long valid) {
+    FILE *file = fopen(path, "ab");
+    if (!file)
+        return NULL;
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+    // drop a record torn by a crash so new records follow the last complete one
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) > valid && ftruncate(fileno(file), valid)) {
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+bool table_journal_open(table_t *table, const char *path) {
+    struct table_journal *journal;
+    long valid;
+    table_journal_close(table);
+    if (!_table_journal_replay(table, path, &valid) ||
+        !(journal = calloc(1, sizeof(struct table_journal))))
+        return false;
+    if (!(journal->path = strdup(path)) || !(journal->file = _table_journal_file(path, valid))) {
+        free(journal->path);
+        free(journal);
+        return false;
+    }
+    table->journal = journal;
+    return true;
+}
+
+bool table_journal_sync(table_t *table) {
+    struct table_journal *journal = table->journal;
+    if (!journal)
+        return false;
+    __atomic_store_n(&journal->pending, 0, __ATOMIC_RELAXED);
+    if (fflush(journal->file) || fsync(fileno(journal->file)))
+        _JOURNAL_FAIL(journal);
+    return !_JOURNAL_FAILED(journal);
+}
+
+void table_journal_close(table_t *table) {
+    struct table_journal *journal = table->journal;
+    if (!journal)
+        return;
+    table_journal_sync(table);
+    fclose(journal->file);
+    free(journal->path);
+    free(journal);
+    table->journal = NULL;
+}
+
+static bool _table_sync_dir(const char *path) {
+#ifdef _WIN32
+    // directories can't be opened for fsync here
+    (void)path;
+    return true;
+#else
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (slash == path ? 1 : (size_t)(slash - path)) : 1;
+    char *dir = malloc(len + 1);
+    int fd;
+    bool synced;
+    if (!dir)
+        return false;
+    memcpy(dir, slash ? path : ".", len);
+    dir[len] = '\0';
+    fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0)
+        return false;
+    synced = !fsync(fd);
+    close(fd);
+    return synced;
+#endif
+}
+
+bool table_journal_compact(table_t *table) {
+    struct table_journal *journal = table->journal, compacted = {0};
+    imap_iter_t iter;
+    imap_pair_t pair;
+    table_entry_t *entry;
+    _table_record_t record;
+    const char *key_str, *value;
+    size_t len;
+    char *path;
+    if (!journal)
+        return false;
+    len = strlen(journal->path);
+    if (!(path = malloc(len + sizeof(".tmp"))))
+        return false;
+    memcpy(path, journal->path, len);
+    memcpy(path + len, ".tmp", sizeof(".tmp"));
+    // the live entries go to a new file that replaces the journal only once it is on disk
+    if (!(compacted.file = fopen(path, "wb"))) {
+        free(path);
+        return false;
+    }
+    setvbuf(compacted.file, NULL, _IOFBF, 1 << 16);
+    // synced once below rather than per TABLE_JOURNAL_BATCH records
+    uint32_t now = _NOW();
+    for (pair = _imap_iterate(table->map.tree, &iter, 1); pair.slot; pair = _imap_iterate(table->map.tree, &iter, 0)) {
+        entry = _BOX(_imap_getval64(table->map.tree, pair.slot));
+        if (!_table_expired(entry, now)) {
+            value = _table_journal_record(table, pair.x, entry, &record, &key_str);
+            _table_journal_append(&compacted, &record, key_str, value);
+        }
+    }
+    if (fflush(compacted.file) || fsync(fileno(compacted.file)))
+        compacted.failed = true;
+    fclose(compacted.file);
+    if (compacted.failed || rename(path, journal->path)) {
+        remove(path);
+        free(path);
+        return false;
+    }
+    free(path);
+    fclose(journal->file);
+    journal->pending = 0;
+    if (!(journal->file = fopen(journal->path, "ab"))) {
+        free(journal->path);
+        free(journal);
+        table->journal = NULL;
+        return false;
+    }
+    setvbuf(journal->file, NULL, _IOFBF, 1 << 16);
+    // until the rename itself is on disk a crash can bring back the old journal, and with it lose
+    // every record appended from now on, so the journal counts as failed if that can't be ensured
+    if (!_table_sync_dir(journal->path)) {
+        _JOURNAL_FAIL(journal);
+        return false;
+    }
+    return true;
+}
+
+#define _T_ITER(T, LO, HI, CB, UD)                                         \
     do                                                                     \
     {                                                                      \
         imap_iter_t iter;                                                  \
-        imap_pair_t pair = imap_iterate((T)->map.tree, &iter, 1);          \
-        while (pair.slot)                                                  \
+        imap_pair_t pair;                                                  \
+        _table_seek(&(T)->map, &iter, (LO));                               \
+        pair = _imap_iterate((T)->map.tree, &iter, 0);                     \
+        uint32_t now = _NOW();                                             \
+        while (pair.slot && pair.x <= (HI))                                \
         {                                                                  \
-            uint64_t value = 0;                                            \
-            _table_get((T), pair.x, &value);                               \
-            const char *key = NULL;                                        \
-            uint32_t *slot = imap_lookup(table->keys.tree, pair.x);        \
-            if (slot)                                                      \
-                key = (const char *)imap_getval64(table->keys.tree, slot); \
-            CB(table, pair.x, key, (table_entry_t *)value, (UD));          \
-            pair = imap_iterate((T)->map.tree, &iter, 0);                  \
+            uint64_t value = (uintptr_t)_BOX(_imap_getval64((T)->map.tree, pair.slot)); \
+            if (!_table_expired((table_entry_t *)value, now))              \
+            {                                                              \
+                const char *key = NULL;                                    \
+                uint32_t *slot = _table_peek(&table->keys, pair.x);        \
+                if (slot)                                                  \
+                    key = _table_key_ptr(_imap_getval64(table->keys.tree, slot)); \
+                CB(table, pair.x, key, (table_entry_t *)value, (UD));      \
+            }                                                              \
+            pair = _imap_iterate((T)->map.tree, &iter, 0);                 \
         }                                                                  \
     } while (0)
 
 void _table_each_fn(table_t *table, void(*callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata) {
-    _T_ITER(table, callback, userdata);  
+    _T_ITER(table, 0, UINT64_MAX, callback, userdata);
 }
 
 void _table_each_block(table_t *table, void(^callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata) {
-    _T_ITER(table, callback, userdata);  
+    _T_ITER(table, 0, UINT64_MAX, callback, userdata);
+}
+
+void _table_each_range_fn(table_t *table, table_range_t range, void(*callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata) {
+    _T_ITER(table, range.lo, range.hi, callback, userdata);
+}
+
+void _table_each_range_block(table_t *table, table_range_t range, void(^callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata) {
+    _T_ITER(table, range.lo, range.hi, callback, userdata);
+}
+
+static inline uint64_t imap__node_lo__(imap_node_t *tree, uint32_t mark) {
+    imap_node_t *node = imap__node__(tree, mark);
+    return imap__xpfx__(imap__node_prefix__(node), imap__node_pos__(node));
+}
+
+size_t table_split(table_t *table, table_range_t *ranges, size_t count) {
+    imap_node_t *tree = table->map.tree, *node;
+    uint32_t *buffer, *frontier, *next, *swap, sval, dirn;
+    size_t i, n, m;
+    bool expanded;
+    if (!count)
+        return 0;
+    sval = _T_ROOT(&table->map);
+    if (count == 1 || !(sval & imap__slot_node__)) {
+        ranges[0] = (table_range_t){0, UINT64_MAX};
+        return 1;
+    }
+    // replace inner nodes by their children, level by level, until there are enough subtrees
+    if (!(buffer = TABLE_MALLOC(2 * 16 * count * sizeof(uint32_t))))
+        return 0;
+    frontier = buffer;
+    next = buffer + 16 * count;
+    frontier[0] = sval & imap__slot_value__;
+    n = 1;
+    while (n < count) {
+        expanded = false;
+        for (i = m = 0; i < n; i++) {
+            node = imap__node__(tree, frontier[i]);
+            if (!imap__node_pos__(node)) {
+                next[m++] = frontier[i];
+                continue;
+            }
+            for (dirn = 0; dirn < 16; dirn++)
+                if ((sval = node->vec32[dirn]) & imap__slot_node__)
+                    next[m++] = sval & imap__slot_value__;
+            expanded = true;
+        }
+        if (!expanded)
+            break;
+        swap = frontier, frontier = next, next = swap;
+        n = m;
+    }
+    if (count > n)
+        count = n;
+    // group consecutive subtrees, each range runs up to the start of the next group
+    for (i = 0; i < count; i++) {
+        ranges[i].lo = i ? imap__node_lo__(tree, frontier[i * n / count]) : 0;
+        ranges[i].hi = i + 1 < count ? imap__node_lo__(tree, frontier[(i + 1) * n / count]) - 1 : UINT64_MAX;
+    }
+    TABLE_FREE(buffer);
+    return count;
+}
+
+typedef struct {
+    table_t *table;
+    table_range_t *ranges;
+    size_t count, next;
+    void(*fn)(table_t*, uint64_t, const char*, table_entry_t*, void*);
+    void(^block)(table_t*, uint64_t, const char*, table_entry_t*, void*);
+    void *userdata;
+} _table_worker_t;
+
+static void* _table_worker(void *arg) {
+    _table_worker_t *worker = (_table_worker_t *)arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&worker->next, 1, __ATOMIC_RELAXED)) < worker->count) {
+        if (worker->fn)
+            _table_each_range_fn(worker->table, worker->ranges[i], worker->fn, worker->userdata);
+        else
+            _table_each_range_block(worker->table, worker->ranges[i], worker->block, worker->userdata);
+    }
+    return NULL;
+}
+
+// hands out more ranges than threads so uneven subtrees even out
+static void _table_each_parallel(_table_worker_t *worker, size_t nthreads) {
+    table_range_t all = {0, UINT64_MAX};
+    pthread_t *threads = NULL;
+    size_t i, started = 0;
+    if (!nthreads)
+        nthreads = 1;
+    worker->ranges = TABLE_MALLOC(nthreads * 4 * sizeof(table_range_t));
+    if (!worker->ranges || !(worker->count = table_split(worker->table, worker->ranges, nthreads * 4))) {
+        // out of memory, every entry is still visited by a serial walk on this thread
+        TABLE_FREE(worker->ranges);
+        worker->ranges = &all;
+        worker->count = nthreads = 1;
+    }
+    worker->next = 0;
+    if (nthreads > 1 && (threads = TABLE_MALLOC(nthreads * sizeof(pthread_t))))
+        for (i = 1; i < nthreads; i++)
+            if (!pthread_create(&threads[started], NULL, _table_worker, worker))
+                started++;
+    _table_worker(worker);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    TABLE_FREE(threads);
+    if (worker->ranges != &all)
+        TABLE_FREE(worker->ranges);
+}
+
+void _table_each_parallel_fn(table_t *table, size_t nthreads, void(*callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata) {
+    _table_worker_t worker = {.table = table, .fn = callback, .userdata = userdata};
+    _table_each_parallel(&worker, nthreads);
+}
+
+void _table_each_parallel_block(table_t *table, size_t nthreads, void(^callback)(table_t*, uint64_t, const char*, table_entry_t*, void*), void *userdata) {
+    _table_worker_t worker = {.table = table, .block = callback, .userdata = userdata};
+    _table_each_parallel(&worker, nthreads);
 }
 #endif
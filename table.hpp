@@ -0,0 +1,378 @@
+/* table.hpp -- https://github.com/takeiteasy/table.h
+
+ Copyright (C) 2024  George Watson
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ C++17 wrapper over the imap core in table.h, header only, no blocks
+ or TABLE_IMPLEMENTATION required. See table.h for the imap license. */
+
+#ifndef TABLE_HPP
+#define TABLE_HPP
+#include "table.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace tbl {
+
+// Keys are integers, enums, pointers (used directly as the trie key) or std::string
+// (hashed, looked up through std::string_view without allocating, strings whose hashes
+// collide are chained from the same trie slot). Trivially copyable values up to 8 bytes
+// live in the trie's value cell, anything else in a stable slab. Inserting may move the
+// trie, which invalidates iterators but not slab references.
+template <typename K, typename V, typename Hash = std::hash<std::string_view>>
+class table {
+    static constexpr bool string_key = std::is_same_v<K, std::string>;
+    static_assert(string_key || std::is_integral_v<K> || std::is_enum_v<K> || std::is_pointer_v<K>,
+                  "table keys must be integers, enums, pointers or std::string");
+    static constexpr bool inline_value = !string_key && std::is_trivially_copyable_v<V> &&
+                                         sizeof(V) <= sizeof(uint64_t) && alignof(V) <= alignof(uint64_t);
+    using stored_type = std::conditional_t<string_key, std::pair<const std::string, V>, V>;
+    using key_arg = std::conditional_t<string_key, std::string_view, K>;
+    using key_ref = std::conditional_t<string_key, const std::string &, K>;
+    static constexpr uint64_t npos = UINT64_MAX;
+
+    template <bool Const>
+    class basic_iterator {
+        using owner_type = std::conditional_t<Const, const table, table>;
+        using mapped_ref = std::conditional_t<Const, const V &, V &>;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type = std::ptrdiff_t;
+        using value_type = std::pair<key_ref, mapped_ref>;
+        using reference = value_type;
+        struct pointer {
+            value_type ref;
+            value_type *operator->() { return &ref; }
+        };
+
+        basic_iterator() = default;
+        template <bool C = Const, typename = std::enable_if_t<C>>
+        basic_iterator(const basic_iterator<false> &other)
+            : owner_(other.owner_), iter_(other.iter_), pair_(other.pair_), link_(other.link_),
+              positioned_(other.positioned_) {}
+
+        reference operator*() const { return {owner_->key_at(pair_, link_), owner_->value_at(pair_.slot, link_)}; }
+        pointer operator->() const { return {**this}; }
+
+        basic_iterator &operator++() {
+            if constexpr (string_key)
+                if (owner_->links_[link_] != npos) {
+                    link_ = owner_->links_[link_];
+                    return *this;
+                }
+            // iterators from find() only seek into the trie once they are advanced
+            if (!positioned_) {
+                positioned_ = true;
+                if (pair_.x == UINT64_MAX) {
+                    pair_ = imap_pair_t{};
+                    return *this;
+                }
+                _imap_seek(owner_->map_.tree, &iter_, pair_.x + 1);
+            }
+            pair_ = _imap_iterate(owner_->map_.tree, &iter_, 0);
+            link_ = owner_->head_at(pair_.slot);
+            return *this;
+        }
+        basic_iterator operator++(int) {
+            basic_iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        bool operator==(const basic_iterator &other) const { return pair_.slot == other.pair_.slot && link_ == other.link_; }
+        bool operator!=(const basic_iterator &other) const { return !(*this == other); }
+
+    private:
+        friend class table;
+        basic_iterator(owner_type *owner, imap_pair_t pair, uint64_t link, bool positioned)
+            : owner_(owner), pair_(pair), link_(link), positioned_(positioned) {}
+
+        owner_type *owner_ = nullptr;
+        imap_iter_t iter_{};
+        imap_pair_t pair_{};
+        // the entry in the slot's collision chain (string keys only)
+        uint64_t link_ = 0;
+        bool positioned_ = true;
+    };
+
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using size_type = std::size_t;
+    using iterator = basic_iterator<false>;
+    using const_iterator = basic_iterator<true>;
+
+    table() : map_{_imap_ensure(nullptr, TABLE_INITIAL_CAPACITY), 0, TABLE_INITIAL_CAPACITY, 0} {
+        if (!map_.tree)
+            throw std::bad_alloc();
+    }
+    ~table() { IMAP_ALIGNED_FREE(map_.tree); }
+
+    // the trie is one block, copying it by accident would be expensive
+    table(const table &) = delete;
+    table &operator=(const table &) = delete;
+    table(table &&other) noexcept
+        : map_(std::exchange(other.map_, imap_t{})), values_(std::move(other.values_)), links_(std::move(other.links_)),
+          free_(std::move(other.free_)) {}
+    table &operator=(table &&other) noexcept {
+        if (this != &other) {
+            IMAP_ALIGNED_FREE(map_.tree);
+            map_ = std::exchange(other.map_, imap_t{});
+            values_ = std::move(other.values_);
+            links_ = std::move(other.links_);
+            free_ = std::move(other.free_);
+        }
+        return *this;
+    }
+
+    size_type size() const noexcept { return map_.count; }
+    bool empty() const noexcept { return !map_.count; }
+
+    iterator begin() { return map_.tree ? first<iterator>(this) : end(); }
+    iterator end() { return iterator(); }
+    const_iterator begin() const { return map_.tree ? first<const_iterator>(this) : end(); }
+    const_iterator end() const { return const_iterator(); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    iterator find(key_arg key) {
+        position pos = locate(key);
+        return pos.pair.slot ? iterator(this, pos.pair, pos.link, false) : end();
+    }
+    const_iterator find(key_arg key) const {
+        position pos = locate(key);
+        return pos.pair.slot ? const_iterator(this, pos.pair, pos.link, false) : end();
+    }
+    bool contains(key_arg key) const { return locate(key).pair.slot != nullptr; }
+
+    // whether lookups and inserts try the last leaf they reached first (on by default, kept by
+    // clear), off for random lookups from many threads
+    void finger(bool enable) noexcept { _imap_finger(map_.tree, enable); }
+
+    V &at(key_arg key) {
+        position pos = locate(key);
+        if (!pos.pair.slot)
+            throw std::out_of_range("tbl::table::at");
+        return value_at(pos.pair.slot, pos.link);
+    }
+    const V &at(key_arg key) const { return const_cast<table *>(this)->at(key); }
+    V &operator[](key_arg key) { return (*try_emplace(key).first).second; }
+
+    // constructs V from args only if the key is missing, in a single trie walk
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(key_arg key, Args &&...args) {
+        uint64_t x = hash(key);
+        if (!map_.tree && !(map_ = imap_t{_imap_ensure(nullptr, TABLE_INITIAL_CAPACITY), 0, TABLE_INITIAL_CAPACITY, 0}).tree)
+            throw std::bad_alloc();
+        uint32_t *slot = _imap_slot(&map_, x);
+        if (!slot)
+            throw std::bad_alloc();
+        uint64_t head = npos, index = 0;
+        if (*slot & imap__slot_value__) {
+            if constexpr (string_key) {
+                head = *cell_at(slot);
+                for (uint64_t link = head; link != npos; link = links_[link])
+                    if (stored_at(link).first == key)
+                        return {iterator(this, imap_pair_t{x, slot}, link, false), false};
+            } else
+                return {iterator(this, imap_pair_t{x, slot}, 0, false), false};
+        }
+        // build the value before claiming a cell so a throwing constructor leaves the slot empty
+        if constexpr (inline_value) {
+            V value(std::forward<Args>(args)...);
+            _imap_setval64(map_.tree, slot, 0);
+            ::new (cell_at(slot)) V(value);
+        } else {
+            index = store(key, std::forward<Args>(args)...);
+            // a colliding string goes in front of the slot's chain
+            if constexpr (string_key)
+                links_[index] = head;
+            _imap_setval64(map_.tree, slot, index);
+        }
+        map_.count++;
+        return {iterator(this, imap_pair_t{x, slot}, index, false), true};
+    }
+
+    std::pair<iterator, bool> insert(key_arg key, const V &value) { return try_emplace(key, value); }
+    std::pair<iterator, bool> insert(key_arg key, V &&value) { return try_emplace(key, std::move(value)); }
+
+    template <typename M>
+    std::pair<iterator, bool> insert_or_assign(key_arg key, M &&value) {
+        auto result = try_emplace(key, std::forward<M>(value));
+        if (!result.second)
+            (*result.first).second = std::forward<M>(value);
+        return result;
+    }
+
+    size_type erase(key_arg key) {
+        position pos = locate(key);
+        if (!pos.pair.slot)
+            return 0;
+        if constexpr (!inline_value) {
+            uint64_t index = string_key ? pos.link : *cell_at(pos.pair.slot);
+            free_.push_back(index);
+            values_[index].reset();
+        }
+        map_.count--;
+        // the slot stays while other keys are chained from it
+        if constexpr (string_key) {
+            uint64_t next = links_[pos.link];
+            if (pos.prev != npos) {
+                links_[pos.prev] = next;
+                return 1;
+            }
+            if (next != npos) {
+                _imap_setval64(map_.tree, pos.pair.slot, next);
+                return 1;
+            }
+        }
+        _imap_remove(map_.tree, pos.pair.x);
+        return 1;
+    }
+
+    void clear() {
+        imap_node_t *tree = _imap_ensure(nullptr, TABLE_INITIAL_CAPACITY);
+        if (!tree)
+            throw std::bad_alloc();
+        if (map_.tree)
+            _imap_finger(tree, imap__finger__(map_.tree) != imap__finger_off__);
+        IMAP_ALIGNED_FREE(map_.tree);
+        map_ = imap_t{tree, 0, TABLE_INITIAL_CAPACITY, 0};
+        values_.clear();
+        links_.clear();
+        free_.clear();
+    }
+
+private:
+    struct position {
+        imap_pair_t pair;
+        // the key's entry and its predecessor in the slot's collision chain (string keys only)
+        uint64_t link, prev;
+    };
+
+    static uint64_t hash(key_arg key) {
+        if constexpr (string_key)
+            return static_cast<uint64_t>(Hash{}(key));
+        else if constexpr (std::is_pointer_v<K>)
+            return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key));
+        else
+            return static_cast<uint64_t>(key);
+    }
+
+    template <typename It, typename Owner>
+    static It first(Owner *owner) {
+        It it(owner, imap_pair_t{}, 0, true);
+        it.pair_ = _imap_iterate(owner->map_.tree, &it.iter_, 1);
+        it.link_ = owner->head_at(it.pair_.slot);
+        return it;
+    }
+
+    position locate(key_arg key) const {
+        position pos{imap_pair_t{}, 0, npos};
+        if (!map_.tree)
+            return pos;
+        pos.pair.x = hash(key);
+        uint32_t *slot = _imap_lookup(map_.tree, pos.pair.x);
+        if constexpr (string_key) {
+            for (uint64_t link = slot ? *cell_at(slot) : npos; link != npos; pos.prev = link, link = links_[link])
+                if (stored_at(link).first == key) {
+                    pos.pair.slot = slot;
+                    pos.link = link;
+                    break;
+                }
+        } else
+            pos.pair.slot = slot;
+        return pos;
+    }
+
+    uint64_t *cell_at(uint32_t *slot) const { return &map_.tree->vec64[*slot >> imap__slot_shift__]; }
+
+    uint64_t head_at(uint32_t *slot) const {
+        if constexpr (string_key)
+            return slot ? *cell_at(slot) : 0;
+        return 0;
+    }
+
+    stored_type &stored_at(uint64_t index) const {
+        return *const_cast<std::optional<stored_type> &>(values_[index]);
+    }
+
+    key_ref key_at(imap_pair_t pair, uint64_t link) const {
+        if constexpr (string_key)
+            return stored_at(link).first;
+        else if constexpr (std::is_pointer_v<K>)
+            return reinterpret_cast<K>(static_cast<uintptr_t>(pair.x));
+        else
+            return static_cast<K>(pair.x);
+    }
+
+    V &value_at(uint32_t *slot, uint64_t link) const {
+        if constexpr (inline_value)
+            return *std::launder(reinterpret_cast<V *>(cell_at(slot)));
+        else if constexpr (string_key)
+            return stored_at(link).second;
+        else
+            return stored_at(*cell_at(slot));
+    }
+
+    template <typename... Args>
+    uint64_t store(key_arg key, Args &&...args) {
+        uint64_t index;
+        if (!free_.empty()) {
+            index = free_.back();
+            free_.pop_back();
+        } else {
+            index = values_.size();
+            values_.emplace_back();
+        }
+        try {
+            if constexpr (string_key)
+                if (links_.size() < values_.size())
+                    links_.resize(values_.size(), npos);
+            if constexpr (string_key)
+                values_[index].emplace(std::piecewise_construct, std::forward_as_tuple(key),
+                                       std::forward_as_tuple(std::forward<Args>(args)...));
+            else
+                values_[index].emplace(std::forward<Args>(args)...);
+        } catch (...) {
+            free_.push_back(index);
+            throw;
+        }
+        return index;
+    }
+
+    imap_t map_;
+    std::deque<std::optional<stored_type>> values_;
+    // next entry in each string key's collision chain, npos at the end
+    std::vector<uint64_t> links_;
+    std::vector<uint64_t> free_;
+};
+
+} // namespace tbl
+#endif // TABLE_HPP
@@ -1,12 +1,17 @@
 #define TABLE_IMPLEMENTATION
 #include "table.h"
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 typedef struct test {
     int dummyA;
     float dummyB;
 } dummy_t;
 
+TABLE_DEFINE(counters, uint64_t, uint64_t)
+TABLE_DEFINE(dummies, int, dummy_t)
+
 int main(int argc, const char *argv[]) {
     table_t table = table();
 
@@ -41,12 +46,210 @@ int main(int argc, const char *argv[]) {
             printf("Key: %llu, Value: %llu\n", key, entry->value);
     });
 
+    int64_t counted = 0;
+    if (table_incr(&table, "hits", 1) != 1 ||
+        table_incr(&table, "hits", 2) != 3 ||
+        !table_incr_atomic(&table, "hits", 4, &counted) || counted != 7 ||
+        table_incr_atomic(&table, "test1", 1, &counted) || table_incr_atomic(&table, "misses", 1, &counted))
+        return 1;
+    table_upsert(&table, "hits", NULL, ^(table_t *table, uint64_t key, table_entry_t *entry, bool exists, void *userdata) {
+        entry->value = exists ? entry->value * 2 : 0;
+    });
+    int hits = 0;
+    if (!table_get(&table, "hits", &hits) || hits != 14)
+        return 1;
+
+    table_t snapshot = table_snapshot(&table);
+    table_set(&table, "test1", "changed");
+    const char *before = NULL;
+    if (!table_get(&snapshot, "test1", &before) || strcmp(before, "poopoo") ||
+        snapshot.map.tree != table.map.tree)
+        return 1;
+    table_free(&snapshot);
+
+    // views keep their version through the trie growing under them and outlive their table
+    table_t owner = table();
+    for (int i = 0; i < 1000; i++)
+        table_set(&owner, i, i);
+    table_t view = table_snapshot(&owner);
+    for (int i = 1000; i < 5000; i++)
+        table_set(&owner, i, i);
+    for (int i = 0; i < 1000; i += 2)
+        table_del(&owner, i);
+    int value = 0;
+    if (view.map.tree == owner.map.tree || view.map.count != 1000 || table_has(&view, 1000) ||
+        !table_get(&view, 998, &value) || value != 998 || table_has(&owner, 998))
+        return 1;
+    table_free(&owner);
+    if (!table_get(&view, 500, &value) || value != 500 || !table_get(&view, 999, &value) || value != 999)
+        return 1;
+    table_free(&view);
+
+    // the nodes a view kept alive go back to the trie on the first write after its release
+    owner = table();
+    for (int i = 0; i < 64; i++)
+        table_set(&owner, i, i);
+    view = table_snapshot(&owner);
+    for (int i = 0; i < 64; i++)
+        table_set(&owner, i, -i);
+    table_free(&view);
+    table_set(&owner, 0, 0);
+    uint32_t mark = owner.map.tree->vec32[imap__tree_mark__];
+    for (int i = 64; i < 128; i++)
+        table_set(&owner, i, i);
+    if (owner.snapshots || owner.map.tree->vec32[imap__tree_mark__] != mark)
+        return 1;
+    table_free(&owner);
+
+    table_t clone, shallow;
+    if (!table_clone(&table, &clone, 0) || !table_clone(&table, &shallow, TABLE_CLONE_SHALLOW))
+        return 1;
+    table_set(&clone, "test1", "cloned");
+    const char *original = NULL;
+    if (!table_get(&table, "test1", &original) || strcmp(original, "changed") ||
+        !table_get(&shallow, "test1", &original) || strcmp(original, "changed"))
+        return 1;
+    table_free(&shallow);
+    table_free(&clone);
+
+    table_set_ttl(&table, "session", "token", 3600);
+    if (!table_has(&table, "session") || table_expire(&table, 16) != 0 ||
+        table_clone(&table, &shallow, TABLE_CLONE_SHALLOW))
+        return 1;
+
+    table_t timed = table();
+    table_cache(&timed, 0, 1 << 20, NULL, NULL);
+    table_set_ttl(&timed, "short", "lived for a second", 1);
+    table_set_ttl(&timed, "reused", "lived for a second", 1);
+    table_set(&timed, "kept", 1);
+    sleep(2);
+    const char *stale = NULL;
+    if (table_has(&timed, "short") || table_get(&timed, "short", &stale) || stale)
+        return 1;
+    // incrementing an expired entry reuses its box as a new key
+    if (table_incr(&timed, "reused", 2) != 2 || table_expire(&timed, 16) != 1 || table_expire(&timed, 16) != 0 ||
+        timed.map.count != 2 || timed.cache.bytes != 2 * sizeof(table_entry_t))
+        return 1;
+    table_free(&timed);
+
+    __block size_t visited = 0;
+    table_each_parallel(&table, 4, NULL, ^(table_t *table, uint64_t key, const char *key_str, table_entry_t *entry, void *userdata) {
+        __atomic_add_fetch(&visited, 1, __ATOMIC_RELAXED);
+    });
+    table_range_t ranges[4];
+    size_t nranges = table_split(&table, ranges, 4);
+    if (visited != table.map.count || !nranges || ranges[nranges - 1].hi != UINT64_MAX)
+        return 1;
+
     table_set(&table, "test3", 3.14159);
     double *pi = NULL;
     table_get(&table, "test3", &pi);
     printf("Pi: %f\n", *pi);
     assert(*pi == 3.14159);
 
+    table_set(&table, "short", "US");
+    table_set(&table, "long", "a string too long to inline");
+    const char *code = NULL, *sentence = NULL, *replaced = NULL, *reused = NULL;
+    table_get(&table, "long", &replaced);
+    table_set(&table, "long", "overwritten by a long value");
+    // the next string of the same 32 byte size class lands in the space the old value freed
+    table_set(&table, "other", "reusing the same freed space");
+    if (!table_get(&table, "short", &code) || strcmp(code, "US") ||
+        !table_get(&table, "long", &sentence) || strcmp(sentence, "overwritten by a long value") ||
+        !table_get(&table, "other", &reused) || strcmp(reused, "reusing the same freed space") ||
+        reused != replaced)
+        return 1;
+
     table_free(&table);
+
+    counters_t squares = counters();
+    for (uint64_t i = 0; i < 64; i++)
+        counters_set(&squares, i, i * i);
+    (*counters_ref(&squares, 8))++;
+    uint64_t count = 0;
+    if (!counters_get(&squares, 8, &count) || count != 65 ||
+        !counters_del(&squares, 8) || counters_has(&squares, 8))
+        return 1;
+    // emptying a leaf frees it while the finger may still point at it
+    for (uint64_t i = 16; i < 32; i++)
+        counters_del(&squares, i);
+    counters_set(&squares, 20, 1);
+    if (counters_has(&squares, 21) || !counters_get(&squares, 20, &count) || count != 1 ||
+        !counters_get(&squares, 33, &count) || count != 33 * 33)
+        return 1;
+    // with the finger off every lookup and insert walks from the root and leaves the header alone
+    counters_finger(&squares, false);
+    for (uint64_t i = 64; i < 128; i++)
+        counters_set(&squares, i, i);
+    for (uint64_t i = 0; i < 128; i++)
+        counters_has(&squares, i);
+    if (squares.map.tree->vec32[imap__tree_fngr__] != imap__finger_off__ ||
+        !counters_get(&squares, 100, &count) || count != 100)
+        return 1;
+    // back on, a lookup in a leaf tagged 0 (one in 64) takes it
+    counters_finger(&squares, true);
+    counters_get(&squares, 1, &count);
+    if (!squares.map.tree->vec32[imap__tree_fngr__] || squares.map.tree->vec32[imap__tree_fngr__] == imap__finger_off__)
+        return 1;
+    counters_free(&squares);
+
+    dummies_t records = dummies();
+    dummies_set(&records, -1, poo);
+    dummy_t poo_copy;
+    if (!dummies_get(&records, -1, &poo_copy) || poo_copy.dummyB != poo.dummyB)
+        return 1;
+    dummies_free(&records);
+
+    table_t cache = table();
+    __block int evicted = 0;
+    table_cache(&cache, 4, 0, ^(table_t *table, uint64_t key, const char *key_str, table_entry_t *entry, void *userdata) {
+        evicted += key != 0;
+    }, NULL);
+    for (int i = 0; i < 16; i++) {
+        table_set(&cache, i, i);
+        table_has(&cache, 0);
+        table_get(&cache, 0, &dummy);
+    }
+    if (cache.map.count != 4 || evicted != 12 || !table_has(&cache, 0) || !table_has(&cache, 15) ||
+        table_clone(&cache, &shallow, TABLE_CLONE_SHALLOW))
+        return 1;
+    table_free(&cache);
+
+    table_t journaled = table();
+    remove("test.journal");
+    if (!table_journal_open(&journaled, "test.journal"))
+        return 1;
+    for (int i = 0; i < 100; i++)
+        table_set(&journaled, i, i);
+    table_del(&journaled, 50);
+    table_set(&journaled, "test1", "journaled");
+    table_incr(&journaled, "hits", 2);
+    table_free(&journaled);
+    table_t replayed = table();
+    const char *restored = NULL;
+    if (!table_journal_open(&replayed, "test.journal") || replayed.map.count != 101 ||
+        table_has(&replayed, 50) || !table_get(&replayed, "test1", &restored) || strcmp(restored, "journaled") ||
+        !table_journal_compact(&replayed))
+        return 1;
+    table_free(&replayed);
+    // a record torn at the end of the journal is dropped, a corrupt one keeps it from opening
+    FILE *file = fopen("test.journal", "ab");
+    fwrite("torn", 4, 1, file);
+    fclose(file);
+    replayed = table();
+    if (!table_journal_open(&replayed, "test.journal") || replayed.map.count != 101)
+        return 1;
+    table_free(&replayed);
+    file = fopen("test.journal", "r+b");
+    fseek(file, 24, SEEK_SET);
+    int byte = fgetc(file);
+    fseek(file, 24, SEEK_SET);
+    fputc(byte ^ 1, file);
+    fclose(file);
+    replayed = table();
+    if (table_journal_open(&replayed, "test.journal") || replayed.journal)
+        return 1;
+    table_free(&replayed);
+    remove("test.journal");
     return 0;
 }
@@ -0,0 +1,95 @@
+#include "table.hpp"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct dummy_t {
+    int dummyA;
+    float dummyB;
+};
+
+struct collide {
+    size_t operator()(std::string_view) const { return 42; }
+};
+
+int main(int argc, const char *argv[]) {
+    tbl::table<std::string, std::string> strings;
+    strings["test1"] = "poopoo";
+    strings.insert("test2", "peepee");
+    if (strings.size() != 2 ||
+        !strings.contains("test1") ||
+        strings.contains("test3") ||
+        strings.at("test2") != "peepee")
+        return 1;
+    if (strings.insert("test1", "changed").second ||
+        !strings.insert_or_assign("test1", "changed").first->second.size())
+        return 1;
+    auto it = strings.find(std::string("test1"));
+    if (it == strings.end() || it->first != "test1" || it->second != "changed")
+        return 1;
+    if (strings.erase("test2") != 1 || strings.erase("test2") != 0 || strings.size() != 1)
+        return 1;
+    for (auto [key, value] : strings)
+        printf("Key: %s, Value: %s\n", key.c_str(), value.c_str());
+
+    // every key hashes the same, so they all share one trie slot
+    tbl::table<std::string, int, collide> collisions;
+    for (int i = 0; i < 8; i++)
+        collisions["key" + std::to_string(i)] = i;
+    if (collisions.size() != 8 || collisions.insert("key3", 0).second || collisions.at("key5") != 5 ||
+        collisions.contains("key8") || collisions.find("key8") != collisions.end())
+        return 1;
+    int sum = 0, rest = 0;
+    for (auto [key, value] : collisions)
+        sum += value;
+    for (auto found = collisions.find("key4"); found != collisions.end(); ++found)
+        rest++;
+    // unchain the head, the tail and one in between
+    if (sum != 28 || rest < 1 || rest > 8 || collisions.erase("key7") != 1 || collisions.erase("key0") != 1 ||
+        collisions.erase("key3") != 1 || collisions.erase("key3") != 0 || collisions.size() != 5 ||
+        collisions.contains("key3") || collisions.at("key6") != 6 || collisions.at("key1") != 1)
+        return 1;
+
+    tbl::table<uint64_t, dummy_t> dummies;
+    for (int i = 0; i < 1000; i++)
+        dummies.try_emplace(i * 3, dummy_t{i, i * .5f});
+    if (dummies.size() != 1000 || dummies.at(300).dummyA != 100)
+        return 1;
+    // iteration is in key order and find() iterators can be advanced
+    uint64_t last = 0, visited = 0;
+    for (auto [key, value] : dummies) {
+        if ((visited && key <= last) || value.dummyA * 3 != (int)key)
+            return 1;
+        last = key;
+        visited++;
+    }
+    auto next = dummies.find(300);
+    if (visited != 1000 || (++next)->first != 303)
+        return 1;
+    for (int i = 0; i < 1000; i += 2)
+        dummies.erase(i * 3);
+    if (dummies.size() != 500 || dummies.contains(0) || !dummies.contains(3))
+        return 1;
+    dummies.finger(false);
+    dummies.clear();
+    dummies[9] = {3, 0.f};
+    if (!dummies.contains(9) || dummies.contains(3))
+        return 1;
+
+    tbl::table<int, std::vector<int>> lists;
+    lists[7].push_back(1);
+    lists[7].push_back(2);
+    lists.erase(7);
+    lists[8].push_back(3);
+    if (lists.size() != 1 || lists.at(8).size() != 1 || lists.find(7) != lists.end())
+        return 1;
+
+    tbl::table<int, std::vector<int>> moved = std::move(lists);
+    if (moved.at(8)[0] != 3 || !lists.empty() || lists.begin() != lists.end())
+        return 1;
+    lists[1].push_back(2);
+    moved.clear();
+    if (!moved.empty() || lists.size() != 1)
+        return 1;
+    return 0;
+}